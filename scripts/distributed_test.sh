@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+# 分布式模式的本地测试: 一个协调者和几个工作节点共用一个任务目录,
+# 在一个节点持有分块时强制结束它, 检查任务能够完成并且每张输入都有输出
+#
+#   scripts/distributed_test.sh <photo_watermark_cli> <带 EXIF 的 jpg 目录> [工作节点数]
+
+set -u
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <photo_watermark_cli> <input dir> [workers]" >&2
+    exit 1
+fi
+
+cli=$1
+input=$2
+workers=${3:-3}
+lease=3
+work_dir=$(mktemp -d)
+job=$work_dir/job
+output=$work_dir/out
+pids=()
+
+cleanup()
+{
+    kill "${pids[@]}" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$work_dir"
+}
+trap cleanup EXIT
+
+mapfile -t inputs < <(cd "$input" && find . -type f \( -iname '*.jpg' -o -iname '*.jpeg' \) | sort)
+if [ ${#inputs[@]} -eq 0 ]; then
+    echo "No jpg files in $input" >&2
+    exit 1
+fi
+
+"$cli" -i "$input" -o "$output" --quiet --coordinator "$job" --chunk-size 1 &
+coordinator=$!
+pids+=("$coordinator")
+
+for i in $(seq 1 "$workers"); do
+    "$cli" -i "$input" -o "$output" --quiet --worker "$job" --worker-id "w$i" --lease-seconds $lease &
+    pids+=("$!")
+done
+
+# 等 w1 领取到分块后强制结束它, 它的分块要在租约过期后由其他节点收回
+victim=${pids[1]}
+killed=0
+for _ in $(seq 1 600); do
+    held=$(grep -lx w1 "$job"/leases/* 2>/dev/null)
+    if [ -n "$held" ]; then
+        kill -9 "$victim"
+        killed=1
+        echo "Killed w1 while holding chunk $(basename "$held")"
+        break
+    fi
+    sleep 0.1
+done
+if [ $killed -eq 0 ]; then
+    echo "FAIL: w1 never held a chunk" >&2
+    exit 1
+fi
+
+wait "$coordinator"
+status=$?
+if [ $status -ne 0 ] && [ $status -ne 3 ]; then
+    echo "FAIL: coordinator exited with $status" >&2
+    exit 1
+fi
+
+missing=0
+for file in "${inputs[@]}"; do
+    if [ ! -s "$output/$file" ]; then
+        echo "FAIL: no output for $file" >&2
+        missing=$((missing + 1))
+    fi
+done
+chunks=$(ls "$job/chunks" | wc -l)
+done_count=$(ls "$job/done" | wc -l)
+if [ "$done_count" -ne "$chunks" ]; then
+    echo "FAIL: $done_count of $chunks chunks done" >&2
+    exit 1
+fi
+if [ $missing -ne 0 ]; then
+    exit 1
+fi
+echo "OK: ${#inputs[@]} images in $chunks chunks, coordinator exited with $status"
@@ -0,0 +1,104 @@
+﻿#include "bench_work.h"
+#include "exif_reader.h"
+
+#include <chrono>
+#include <QPainter>
+
+namespace
+{
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(double & ms) : ms_(ms), start_(std::chrono::steady_clock::now()) { }
+
+    ~PhaseTimer()
+    {
+        ms_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    double & ms_;
+    std::chrono::steady_clock::time_point start_;
+};
+}
+
+const char * PhaseName(int phase)
+{
+    static const char * names[kPhaseCount] = { "read", "exif", "decode", "canvas", "text", "logo", "encode", "write" };
+    return phase >= 0 && phase < kPhaseCount ? names[phase] : "";
+}
+
+PhaseTimes BenchWork::Measure(const std::string & image_path)
+{
+    PhaseTimes times;
+    ImageTask task;
+    task.input_file = image_path;
+    auto & ms = times.ms;
+
+    {
+        PhaseTimer timer(ms[kPhaseRead]);
+        if (!ReadStage(task))
+            return times;
+    }
+    times.input_bytes = task.file_data.size();
+
+    // 没有 exif 的图片在流水线中会失败, 这里继续执行后面的阶段
+    {
+        PhaseTimer timer(ms[kPhaseExif]);
+        times.exif_ok = PARSE_EXIF_SUCCESS ==
+            ParseExif(reinterpret_cast<const unsigned char *>(task.file_data.constData()),
+                      static_cast<size_t>(task.file_data.size()), task.exif);
+    }
+
+    {
+        PhaseTimer timer(ms[kPhaseDecode]);
+        if (!DecodeImage(task))
+            return times;
+    }
+
+    // 只测量第一个输出尺寸
+    CanvasLayout layout;
+    task.outputs.resize(1);
+    QImage & canvas = task.outputs.front().canvas;
+    {
+        PhaseTimer timer(ms[kPhaseCanvas]);
+        layout = GetCanvasLayout(task.source_img.width(), task.source_img.height());
+        if (!CreateCanvas(canvas, task.source_img, layout))
+            return times;
+        task.source_img = QImage();
+    }
+
+    QPainter painter;
+    painter.begin(&canvas);
+    painter.translate(0, layout.watermark_y);
+    {
+        // Make 为空时 PaintRight 不会绘制 logo
+        easyexif::EXIFInfo text_exif = task.exif;
+        text_exif.Make.clear();
+        PhaseTimer timer(ms[kPhaseText]);
+        PaintLeft(&painter, text_exif, layout.text_x, layout.watermark_height, layout.border_size);
+        PaintRight(&painter, text_exif, layout.width, layout.watermark_height, layout.border_size);
+    }
+    {
+        PhaseTimer timer(ms[kPhaseLogo]);
+        const int right_x = layout.width - layout.text_x;
+        PaintLogo(&painter, task.exif, 0, right_x, layout.border_size);
+    }
+    painter.end();
+
+    {
+        PhaseTimer timer(ms[kPhaseEncode]);
+        if (!EncodeStage(task))
+            return times;
+    }
+    for (const auto & output : task.outputs)
+        times.output_bytes += output.encoded.size();
+
+    {
+        PhaseTimer timer(ms[kPhaseWrite]);
+        if (!WriteStage(task))
+            return times;
+    }
+    times.ok = true;
+    return times;
+}
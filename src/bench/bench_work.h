@@ -0,0 +1,39 @@
+﻿#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+
+#include "photo_watermark.h"
+
+enum BenchPhase
+{
+    kPhaseRead,
+    kPhaseExif,
+    kPhaseDecode,
+    kPhaseCanvas,
+    kPhaseText,
+    kPhaseLogo,
+    kPhaseEncode,
+    kPhaseWrite,
+    kPhaseCount,
+};
+
+const char * PhaseName(int phase);
+
+using PhaseTimes = struct PhaseTimes
+{
+    std::array<double, kPhaseCount> ms = { }; // 各阶段耗时, 毫秒
+    int64_t input_bytes = 0;
+    int64_t output_bytes = 0;
+    bool exif_ok = false;
+    bool ok = false;
+};
+
+// 逐个阶段调用 PhotoWaterMarkWork 的实现并计时, 文字与 logo 分开绘制以便单独统计
+class BenchWork : public PhotoWaterMarkWork
+{
+public:
+    PhaseTimes Measure(const std::string & image_path);
+
+    using PhotoWaterMarkWork::ImageProcessing;
+};
@@ -0,0 +1,120 @@
+﻿#include "kernel_bench.h"
+#include "pixel_kernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <QImage>
+#include <QPainter>
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+constexpr uint32_t kWhite = 0xFFFFFFFF;
+
+double BestMs(int repeat, const std::function<void()> & fn)
+{
+    double best = 0;
+    for (int i = 0; i < repeat; ++i)
+    {
+        const auto start = Clock::now();
+        fn();
+        const double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        best = i == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+}
+
+void PrintRow(const char * kernel, const char * impl, double ms, const QImage & dst)
+{
+    const double bytes = static_cast<double>(dst.sizeInBytes());
+    printf("%-10s%-24s%10.2f%10.2f\n", kernel, impl, ms, bytes / (ms / 1000.0) / (1024.0 * 1024.0 * 1024.0));
+}
+
+// 不同于纯色, 避免源数据被压缩或命中特殊路径
+QImage MakeSource(int width, int height, QImage::Format format)
+{
+    QImage img(width, height, QImage::Format_RGB32);
+    for (int y = 0; y < height; ++y)
+    {
+        auto * line = reinterpret_cast<QRgb *>(img.scanLine(y));
+        for (int x = 0; x < width; ++x)
+            line[x] = qRgb(x & 0xFF, y & 0xFF, (x ^ y) & 0xFF);
+    }
+    return format == QImage::Format_RGB32 ? img : img.convertToFormat(format);
+}
+
+// QPainter 的实现: ARGB32 画布上整体绘制
+void PainterDraw(QImage & canvas, const QImage & source)
+{
+    QPainter painter(&canvas);
+    painter.drawImage(0, 0, source);
+}
+
+void RunConvert(const char * kernel, const QImage & source, QImage & canvas, int repeat,
+                const std::function<void(uint32_t *, const uchar *, size_t)> & row_fn)
+{
+    QImage argb(source.width(), source.height(), QImage::Format_ARGB32);
+    PrintRow(kernel, "QPainter::drawImage", BestMs(repeat, [&] { PainterDraw(argb, source); }), argb);
+    canvas = QImage(source.size(), QImage::Format_RGB32);
+    // 格式相同时 convertToFormat 只是浅拷贝, 改为逐行 memcpy 到预先分配的画布
+    if (source.format() == QImage::Format_RGB32)
+    {
+        const size_t row_bytes = static_cast<size_t>(source.width()) * sizeof(uint32_t);
+        PrintRow(kernel, "memcpy", BestMs(repeat, [&] {
+            for (int y = 0; y < source.height(); ++y)
+                memcpy(canvas.scanLine(y), source.constScanLine(y), row_bytes);
+        }), canvas);
+    }
+    else
+    {
+        PrintRow(kernel, "QImage::convertToFormat",
+                 BestMs(repeat, [&] { canvas = source.convertToFormat(QImage::Format_RGB32); }), canvas);
+        canvas = QImage(source.size(), QImage::Format_RGB32);
+    }
+    for (int level = 0; level <= static_cast<int>(DetectSimdLevel()); ++level)
+    {
+        SetSimdLevel(static_cast<SimdLevel>(level));
+        const double ms = BestMs(repeat, [&] {
+            for (int y = 0; y < source.height(); ++y)
+                row_fn(reinterpret_cast<uint32_t *>(canvas.scanLine(y)), source.constScanLine(y), source.width());
+        });
+        PrintRow(kernel, SimdLevelName(static_cast<SimdLevel>(level)), ms, canvas);
+    }
+}
+}
+
+void RunKernelBench(int width, int height, int repeat)
+{
+    printf("Pixel kernels on %dx%d, best of %d, detected %s\n", width, height, repeat,
+           SimdLevelName(DetectSimdLevel()));
+    printf("%-10s%-24s%10s%10s\n", "kernel", "impl", "ms", "GiB/s");
+
+    QImage canvas(width, height, QImage::Format_ARGB32);
+    PrintRow("fill", "QImage::fill", BestMs(repeat, [&] { canvas.fill(Qt::white); }), canvas);
+    PrintRow("fill", "QPainter::fillRect", BestMs(repeat, [&] {
+        QPainter painter(&canvas);
+        painter.fillRect(canvas.rect(), Qt::white);
+    }), canvas);
+    canvas = QImage(width, height, QImage::Format_RGB32);
+    for (int level = 0; level <= static_cast<int>(DetectSimdLevel()); ++level)
+    {
+        SetSimdLevel(static_cast<SimdLevel>(level));
+        const double ms = BestMs(repeat, [&] {
+            for (int y = 0; y < height; ++y)
+                FillRgb32(reinterpret_cast<uint32_t *>(canvas.scanLine(y)), width, kWhite);
+        });
+        PrintRow("fill", SimdLevelName(static_cast<SimdLevel>(level)), ms, canvas);
+    }
+
+    RunConvert("copy", MakeSource(width, height, QImage::Format_RGB32), canvas, repeat,
+               [](uint32_t * dst, const uchar * src, size_t count) {
+                   CopyRgb32(dst, reinterpret_cast<const uint32_t *>(src), count);
+               });
+    RunConvert("rgb888", MakeSource(width, height, QImage::Format_RGB888), canvas, repeat, Rgb888ToRgb32);
+    RunConvert("gray8", MakeSource(width, height, QImage::Format_Grayscale8), canvas, repeat, Gray8ToRgb32);
+    SetSimdLevel(DetectSimdLevel());
+}
@@ -0,0 +1,5 @@
+﻿#pragma once
+
+// 画布合成所用像素函数的微基准, 每个函数在各个 SIMD 级别下与原先的 QPainter 实现对比
+// 每项取 repeat 次中最快的一次
+void RunKernelBench(int width, int height, int repeat);
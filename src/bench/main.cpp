@@ -0,0 +1,328 @@
+﻿#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <thread>
+#include <vector>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFile>
+#include <QGuiApplication>
+#include <QTemporaryDir>
+
+#if defined(WIN32) || defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "bench_work.h"
+#include "kernel_bench.h"
+#include "synthetic_jpeg.h"
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+using CorpusFile = struct CorpusFile
+{
+    QString group; // SyntheticName
+    std::string path;
+    int64_t size = 0;
+};
+
+double PeakRssMiB()
+{
+#if defined(WIN32) || defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters = { };
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return static_cast<double>(counters.PeakWorkingSetSize) / (1024.0 * 1024.0);
+#else
+    rusage usage = { };
+    if (0 != getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#if defined(__APPLE__)
+    return static_cast<double>(usage.ru_maxrss) / (1024.0 * 1024.0); // 字节
+#else
+    return static_cast<double>(usage.ru_maxrss) / 1024.0; // KiB
+#endif
+#endif
+}
+
+double Seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+bool ParseSizes(const QString & text, std::vector<std::pair<int, int>> & sizes)
+{
+    for (const auto & item : text.split(QChar(','), Qt::SkipEmptyParts))
+    {
+        const auto parts = item.split(QChar('x'));
+        bool ok_w = false;
+        bool ok_h = false;
+        const int w = parts.size() == 2 ? parts[0].toInt(&ok_w) : 0;
+        const int h = parts.size() == 2 ? parts[1].toInt(&ok_h) : 0;
+        if (!ok_w || !ok_h || w <= 0 || h <= 0)
+            return false;
+        sizes.emplace_back(w, h);
+    }
+    return !sizes.empty();
+}
+
+bool ParseThreads(const QString & text, std::vector<int> & threads)
+{
+    for (const auto & item : text.split(QChar(','), Qt::SkipEmptyParts))
+    {
+        bool ok = false;
+        const int count = item.toInt(&ok);
+        if (!ok || count <= 0)
+            return false;
+        threads.push_back(count);
+    }
+    return !threads.empty();
+}
+
+std::vector<int> DefaultThreads()
+{
+    const int hw = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    std::vector<int> threads;
+    for (int count = 1; count < hw; count *= 2)
+        threads.push_back(count);
+    threads.push_back(hw);
+    return threads;
+}
+
+// 每种尺寸生成无 exif / exif / exif+gps / exif+gps+旋转 四种图片, 每种 copies 份
+bool GenerateCorpus(const QString & dir, const std::vector<std::pair<int, int>> & sizes, int copies,
+                    std::vector<CorpusFile> & corpus)
+{
+    for (const auto & [width, height] : sizes)
+    {
+        const SyntheticSpec specs[] = {
+            { width, height, false, false, 1 },
+            { width, height, true, false, 1 },
+            { width, height, true, true, 1 },
+            { width, height, true, true, 6 },
+        };
+        for (const auto & spec : specs)
+        {
+            const QString name = SyntheticName(spec);
+            fprintf(stderr, "Generating %s\n", qPrintable(name));
+            const QByteArray data = GenerateSyntheticJpeg(spec);
+            if (data.isEmpty())
+            {
+                fprintf(stderr, "Generate %s failed.\n", qPrintable(name));
+                return false;
+            }
+            for (int i = 0; i < copies; ++i)
+            {
+                const QString path = QDir(dir).filePath(QStringLiteral("%1_%2.jpg").arg(name).arg(i));
+                QFile file(path);
+                if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size())
+                {
+                    fprintf(stderr, "Write %s failed.\n", qPrintable(path));
+                    return false;
+                }
+                corpus.push_back({ name, QDir::toNativeSeparators(path).toStdString(), data.size() });
+            }
+        }
+    }
+    return true;
+}
+
+void PrintPhases(BenchWork & work, const std::vector<CorpusFile> & corpus, bool cold_text)
+{
+    std::map<QString, std::pair<PhaseTimes, int>> groups; // <group, <sum, count>>
+    std::vector<QString> order;
+    for (const auto & file : corpus)
+    {
+        if (cold_text)
+            work.ClearTextCache();
+        const PhaseTimes times = work.Measure(file.path);
+        auto [it, inserted] = groups.try_emplace(file.group);
+        if (inserted)
+            order.push_back(file.group);
+        auto & [sum, count] = it->second;
+        for (int phase = 0; phase < kPhaseCount; ++phase)
+            sum.ms[phase] += times.ms[phase];
+        sum.input_bytes += times.input_bytes;
+        sum.output_bytes += times.output_bytes;
+        sum.exif_ok = times.exif_ok;
+        sum.ok = times.ok;
+        ++count;
+    }
+
+    printf("\nPer phase, average ms per image%s:\n", cold_text ? " (text cache cleared per image)" : "");
+    printf("%-28s", "image");
+    for (int phase = 0; phase < kPhaseCount; ++phase)
+        printf("%9s", PhaseName(phase));
+    printf("%9s %s\n", "total", "note");
+    for (const auto & group : order)
+    {
+        const auto & [sum, count] = groups[group];
+        double total = 0;
+        printf("%-28s", qPrintable(group));
+        for (int phase = 0; phase < kPhaseCount; ++phase)
+        {
+            printf("%9.2f", sum.ms[phase] / count);
+            total += sum.ms[phase] / count;
+        }
+        printf("%9.2f %s\n", total, !sum.ok ? "failed" : sum.exif_ok ? "" : "no exif, fails in pipeline");
+    }
+}
+
+void PrintThroughput(const char * mode, int images, int failed, int64_t bytes, double seconds)
+{
+    printf("%-12s%8d%8d%12.2f%12.2f%14.1f\n", mode, images, failed,
+           images / seconds, static_cast<double>(bytes) / (1024.0 * 1024.0) / seconds, PeakRssMiB());
+}
+
+// 缓冲池的命中/未命中次数
+void PrintPoolStats(const BenchWork & work)
+{
+    printf("%12s", "pool");
+    for (int kind = 0; kind < static_cast<int>(PoolKind::kCount); ++kind)
+    {
+        const auto stats = work.GetBufferPoolStats(static_cast<PoolKind>(kind));
+        printf("  %s %zu/%zu", BufferPool::KindName(static_cast<PoolKind>(kind)), stats.hits, stats.misses);
+    }
+    printf("\n");
+}
+}
+
+int main(int argc, char * argv[])
+{
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication a(argc, argv);
+    QGuiApplication::setApplicationName(QStringLiteral("photo_watermark_bench"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral(
+        "Benchmark the per-image hot path on generated JPEGs.\n"
+        "Peak RSS is for the whole process and never decreases, "
+        "run a single thread count to measure it in isolation."));
+    parser.addHelpOption();
+    parser.addOptions({
+        { QStringLiteral("sizes"), QStringLiteral("Image sizes, default 1920x1280,4000x3000,6000x4000."), QStringLiteral("WxH,...") },
+        { QStringLiteral("copies"), QStringLiteral("Copies of each generated image, default 4."), QStringLiteral("count") },
+        { QStringLiteral("threads"), QStringLiteral("Thread counts for the pipeline runs, default 1,2,4..cores."), QStringLiteral("list") },
+        { QStringLiteral("dir"), QStringLiteral("Work directory, default a temporary directory."), QStringLiteral("dir") },
+        { QStringLiteral("cold-text"), QStringLiteral("Clear the text cache before every image in the phase run.") },
+        { QStringLiteral("no-mmap"), QStringLiteral("Read input files instead of mapping them.") },
+        { QStringLiteral("quality"), QStringLiteral("Encoder quality, default 100."), QStringLiteral("quality") },
+        { QStringLiteral("fast-encode"), QStringLiteral("Encode with libjpeg directly instead of QImageWriter.") },
+        { QStringLiteral("long-edge"), QStringLiteral("Scale outputs to this long edge, default source size."), QStringLiteral("px") },
+        { QStringLiteral("kernels"), QStringLiteral("Only run the pixel kernel microbenchmarks on the first of --sizes.") },
+        { QStringLiteral("repeat"), QStringLiteral("Repeats per kernel, default 5."), QStringLiteral("count") },
+    });
+    parser.process(a);
+
+    std::vector<std::pair<int, int>> sizes;
+    if (!ParseSizes(parser.value(QStringLiteral("sizes")).isEmpty()
+                        ? QStringLiteral("1920x1280,4000x3000,6000x4000")
+                        : parser.value(QStringLiteral("sizes")), sizes))
+    {
+        fprintf(stderr, "Invalid --sizes.\n");
+        return 1;
+    }
+    std::vector<int> threads;
+    if (parser.isSet(QStringLiteral("threads")) && !ParseThreads(parser.value(QStringLiteral("threads")), threads))
+    {
+        fprintf(stderr, "Invalid --threads.\n");
+        return 1;
+    }
+    if (parser.isSet(QStringLiteral("kernels")))
+    {
+        const int repeat = parser.isSet(QStringLiteral("repeat")) ? std::max(1, parser.value(QStringLiteral("repeat")).toInt()) : 5;
+        RunKernelBench(sizes.front().first, sizes.front().second, repeat);
+        return 0;
+    }
+    if (threads.empty())
+        threads = DefaultThreads();
+    int copies = 4;
+    if (parser.isSet(QStringLiteral("copies")))
+        copies = std::max(1, parser.value(QStringLiteral("copies")).toInt());
+
+    QTemporaryDir temp_dir;
+    const QString work_dir = parser.isSet(QStringLiteral("dir")) ? parser.value(QStringLiteral("dir")) : temp_dir.path();
+    const QString input_dir = QDir(work_dir).filePath(QStringLiteral("input"));
+    const QString output_dir = QDir(work_dir).filePath(QStringLiteral("output"));
+    if (!QDir().mkpath(input_dir) || !QDir().mkpath(output_dir))
+    {
+        fprintf(stderr, "Create %s failed.\n", qPrintable(work_dir));
+        return 1;
+    }
+
+    PhotoWaterMarkWork::LoadBundledFonts();
+
+    std::vector<CorpusFile> corpus;
+    if (!GenerateCorpus(input_dir, sizes, copies, corpus))
+        return 1;
+    int64_t corpus_bytes = 0;
+    for (const auto & file : corpus)
+        corpus_bytes += file.size;
+
+    WaterMarkParam p = { };
+    p.input_path = input_dir.toStdString();
+    p.output_path = output_dir.toStdString();
+    p.font = QFont(QStringLiteral("MiSans Latin"));
+    p.logo = "Auto";
+    p.use_mmap = !parser.isSet(QStringLiteral("no-mmap"));
+    p.incremental = false;
+    Rendition rendition;
+    rendition.long_edge = parser.value(QStringLiteral("long-edge")).toInt();
+    if (parser.isSet(QStringLiteral("quality")))
+        rendition.quality = parser.value(QStringLiteral("quality")).toInt();
+    rendition.fast_encode = parser.isSet(QStringLiteral("fast-encode"));
+    p.renditions.push_back(rendition);
+    p.text_settings[TextPosition::kLeftTop] = { TextType::kModel, { }, 600 };
+    p.text_settings[TextPosition::kLeftBottom] = { TextType::kLensModel, { }, 300 };
+    p.text_settings[TextPosition::kRightTop] = { TextType::kExposureParam, { }, 600 };
+    p.text_settings[TextPosition::kRightBottom] = { TextType::kData, { }, 300 };
+
+    {
+        BenchWork work;
+        if (!work.Init(p, nullptr))
+            return 2;
+        PrintPhases(work, corpus, parser.isSet(QStringLiteral("cold-text")));
+    }
+
+    printf("\n%-12s%8s%8s%12s%12s%14s\n", "mode", "images", "failed", "images/s", "MB/s", "peak RSS MiB");
+    {
+        BenchWork work;
+        if (!work.Init(p, nullptr))
+            return 2;
+        int failed = 0;
+        const auto start = Clock::now();
+        for (const auto & file : corpus)
+            if (!work.ImageProcessing(file.path))
+                ++failed;
+        PrintThroughput("serial", static_cast<int>(corpus.size()), failed, corpus_bytes, Seconds(start));
+        PrintPoolStats(work);
+    }
+
+    for (const int count : threads)
+    {
+        int failed = 0;
+        p.thread_count = count;
+        BenchWork work;
+        progress_callback cb = [&failed](int, int failed_count, int, bool, const PipelineMetrics &) { failed = failed_count; };
+        if (!work.Init(p, cb))
+            return 2;
+        const auto start = Clock::now();
+        if (!work.WorkStart())
+            return 2;
+        work.Wait();
+        const QByteArray mode = QStringLiteral("threads=%1").arg(count).toUtf8();
+        PrintThroughput(mode.constData(), static_cast<int>(corpus.size()), failed, corpus_bytes, Seconds(start));
+        PrintPoolStats(work);
+    }
+    return 0;
+}
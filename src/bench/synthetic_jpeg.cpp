@@ -0,0 +1,229 @@
+﻿#include "synthetic_jpeg.h"
+
+#include <cstdint>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+#include <QBuffer>
+#include <QImage>
+#include <QImageWriter>
+
+namespace
+{
+enum TiffType : uint16_t
+{
+    kTiffAscii = 2,
+    kTiffShort = 3,
+    kTiffLong = 4,
+    kTiffRational = 5,
+};
+
+using IfdEntry = struct IfdEntry
+{
+    uint16_t tag = 0;
+    uint16_t type = 0;
+    uint32_t count = 0;
+    QByteArray value; // 小端序
+};
+
+void Put16(QByteArray & out, uint16_t v)
+{
+    out.append(static_cast<char>(v & 0xFF));
+    out.append(static_cast<char>(v >> 8));
+}
+
+void Put32(QByteArray & out, uint32_t v)
+{
+    Put16(out, static_cast<uint16_t>(v & 0xFFFF));
+    Put16(out, static_cast<uint16_t>(v >> 16));
+}
+
+IfdEntry Ascii(uint16_t tag, const char * text)
+{
+    IfdEntry entry{ tag, kTiffAscii, 0, QByteArray(text) };
+    entry.value.append('\0');
+    entry.count = static_cast<uint32_t>(entry.value.size());
+    return entry;
+}
+
+IfdEntry Short(uint16_t tag, uint16_t v)
+{
+    IfdEntry entry{ tag, kTiffShort, 1, { } };
+    Put16(entry.value, v);
+    return entry;
+}
+
+IfdEntry Long(uint16_t tag, uint32_t v)
+{
+    IfdEntry entry{ tag, kTiffLong, 1, { } };
+    Put32(entry.value, v);
+    return entry;
+}
+
+IfdEntry Rationals(uint16_t tag, std::initializer_list<std::pair<uint32_t, uint32_t>> values)
+{
+    IfdEntry entry{ tag, kTiffRational, static_cast<uint32_t>(values.size()), { } };
+    for (const auto & [numerator, denominator] : values)
+    {
+        Put32(entry.value, numerator);
+        Put32(entry.value, denominator);
+    }
+    return entry;
+}
+
+uint32_t IfdSize(const std::vector<IfdEntry> & entries)
+{
+    uint32_t size = 2 + 12 * static_cast<uint32_t>(entries.size()) + 4;
+    for (const auto & entry : entries)
+        if (entry.value.size() > 4)
+            size += static_cast<uint32_t>(entry.value.size() + 1) & ~1u;
+    return size;
+}
+
+// 超过 4 字节的值紧跟在目录之后, 偏移相对 tiff 头
+void AppendIfd(QByteArray & tiff, const std::vector<IfdEntry> & entries)
+{
+    uint32_t data_offset = static_cast<uint32_t>(tiff.size()) + 2 + 12 * static_cast<uint32_t>(entries.size()) + 4;
+    Put16(tiff, static_cast<uint16_t>(entries.size()));
+    for (const auto & entry : entries)
+    {
+        Put16(tiff, entry.tag);
+        Put16(tiff, entry.type);
+        Put32(tiff, entry.count);
+        if (entry.value.size() <= 4)
+        {
+            tiff.append(entry.value);
+            tiff.append(4 - entry.value.size(), '\0');
+        }
+        else
+        {
+            Put32(tiff, data_offset);
+            data_offset += static_cast<uint32_t>(entry.value.size() + 1) & ~1u;
+        }
+    }
+    Put32(tiff, 0);
+    for (const auto & entry : entries)
+    {
+        if (entry.value.size() <= 4)
+            continue;
+        tiff.append(entry.value);
+        if (entry.value.size() % 2)
+            tiff.append('\0');
+    }
+}
+
+QImage GenerateImage(int width, int height)
+{
+    QImage img(width, height, QImage::Format_RGB32);
+    if (img.isNull())
+        return img;
+    // 固定种子, 每次生成的内容相同
+    uint32_t seed = 0x12345678u;
+    for (int y = 0; y < height; ++y)
+    {
+        auto * line = reinterpret_cast<QRgb *>(img.scanLine(y));
+        const int g = y * 255 / height;
+        for (int x = 0; x < width; ++x)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            const int noise = static_cast<int>(seed >> 27) - 16;
+            const int r = x * 255 / width;
+            const int b = (x + y) * 127 / (width + height) + 64;
+            line[x] = qRgb(qBound(0, r + noise, 255), qBound(0, g + noise, 255), qBound(0, b + noise, 255));
+        }
+    }
+    return img;
+}
+}
+
+QString SyntheticName(const SyntheticSpec & spec)
+{
+    QString name = QStringLiteral("%1x%2").arg(spec.width).arg(spec.height);
+    if (!spec.exif)
+        return name + QStringLiteral("_noexif");
+    name += QStringLiteral("_exif");
+    if (spec.gps)
+        name += QStringLiteral("_gps");
+    if (spec.orientation > 1)
+        name += QStringLiteral("_o%1").arg(spec.orientation);
+    return name;
+}
+
+QByteArray BuildExifSegment(const SyntheticSpec & spec)
+{
+    // 标签需要按升序排列
+    std::vector<IfdEntry> ifd0 = {
+        Ascii(0x010F, "Canon"),
+        Ascii(0x0110, "EOS Synthetic"),
+        Short(0x0112, static_cast<uint16_t>(spec.orientation)),
+        Ascii(0x0132, "2024:01:01 12:00:00"),
+        Long(0x8769, 0),
+    };
+    if (spec.gps)
+        ifd0.push_back(Long(0x8825, 0));
+
+    const std::vector<IfdEntry> exif_ifd = {
+        Rationals(0x829A, { { 1, 250 } }),
+        Rationals(0x829D, { { 28, 10 } }),
+        Short(0x8827, 400),
+        Ascii(0x9003, "2024:01:01 12:00:00"),
+        Rationals(0x920A, { { 50, 1 } }),
+        Short(0xA405, 50),
+        Ascii(0xA434, "Synthetic 50mm F2.8"),
+    };
+
+    const std::vector<IfdEntry> gps_ifd = {
+        Ascii(0x0001, "N"),
+        Rationals(0x0002, { { 31, 1 }, { 14, 1 }, { 1530, 100 } }),
+        Ascii(0x0003, "E"),
+        Rationals(0x0004, { { 121, 1 }, { 28, 1 }, { 4210, 100 } }),
+    };
+
+    const uint32_t exif_offset = 8 + IfdSize(ifd0);
+    const uint32_t gps_offset = exif_offset + IfdSize(exif_ifd);
+    ifd0[4] = Long(0x8769, exif_offset);
+    if (spec.gps)
+        ifd0[5] = Long(0x8825, gps_offset);
+
+    QByteArray tiff("II*\0", 4);
+    Put32(tiff, 8);
+    AppendIfd(tiff, ifd0);
+    AppendIfd(tiff, exif_ifd);
+    if (spec.gps)
+        AppendIfd(tiff, gps_ifd);
+
+    QByteArray segment("\xFF\xE1", 2);
+    const int length = 2 + 6 + static_cast<int>(tiff.size());
+    segment.append(static_cast<char>(length >> 8));
+    segment.append(static_cast<char>(length & 0xFF));
+    segment.append("Exif\0\0", 6);
+    segment.append(tiff);
+    return segment;
+}
+
+QByteArray GenerateSyntheticJpeg(const SyntheticSpec & spec, int quality)
+{
+    const QImage img = GenerateImage(spec.width, spec.height);
+    if (img.isNull())
+        return { };
+
+    QByteArray data;
+    {
+        QBuffer buffer(&data);
+        buffer.open(QIODevice::WriteOnly);
+        QImageWriter writer(&buffer, "jpg");
+        writer.setQuality(quality);
+        if (!writer.write(img))
+            return { };
+    }
+    if (!spec.exif)
+        return data;
+
+    // APP1 放在 SOI 与 JFIF APP0 之后
+    qsizetype insert_pos = 2;
+    const auto * bytes = reinterpret_cast<const unsigned char *>(data.constData());
+    if (data.size() > 6 && bytes[2] == 0xFF && bytes[3] == 0xE0)
+        insert_pos = 4 + ((bytes[4] << 8) | bytes[5]);
+    data.insert(insert_pos, BuildExifSegment(spec));
+    return data;
+}
@@ -0,0 +1,21 @@
+﻿#pragma once
+#include <QByteArray>
+#include <QString>
+
+// 生成测试用的 jpeg, 内容为渐变加噪声, 压缩率接近真实照片
+using SyntheticSpec = struct SyntheticSpec
+{
+    int width = 0;
+    int height = 0;
+    bool exif = true;
+    bool gps = false;
+    int orientation = 1; // exif Orientation, 6 = 顺时针旋转 90 度
+};
+
+// 文件名中包含尺寸与 exif 组合, 如 4000x3000_exif_gps_o6
+QString SyntheticName(const SyntheticSpec & spec);
+
+// 返回 APP1 段, 包括 0xFFE1 标记与长度
+QByteArray BuildExifSegment(const SyntheticSpec & spec);
+
+QByteArray GenerateSyntheticJpeg(const SyntheticSpec & spec, int quality = 90);
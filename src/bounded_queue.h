@@ -0,0 +1,55 @@
+﻿#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// 多生产者多消费者的有界队列, 队列满时 Push 阻塞以形成背压
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity > 0 ? capacity : 1) { }
+
+    // 阻塞直到有空位, 队列已关闭时返回 false 且 item 保持不变
+    bool Push(T && item)
+    {
+        std::unique_lock lock(mutex_);
+        not_full_.wait(lock, [this] { return closed_ || queue_.size() < capacity_; });
+        if (closed_)
+            return false;
+        queue_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // 阻塞直到有数据, 队列已关闭且取空时返回 false
+    bool Pop(T & item)
+    {
+        std::unique_lock lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+        if (queue_.empty())
+            return false;
+        item = std::move(queue_.front());
+        queue_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // 不再接受新数据, 已入队的数据仍可取出
+    void Close()
+    {
+        std::lock_guard lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> queue_;
+    size_t capacity_;
+    bool closed_ = false;
+};
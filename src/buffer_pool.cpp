@@ -0,0 +1,184 @@
+﻿#include "buffer_pool.h"
+
+#include <algorithm>
+
+void BufferPool::Reset(size_t max_items, const MemoryBudget * budget)
+{
+    std::lock_guard lock(mutex_);
+    max_items_ = max_items;
+    budget_ = budget;
+    idle_bytes_ = 0;
+    for (size_t i = 0; i < kKindCount; ++i)
+    {
+        bytes_[i].clear();
+        images_[i].clear();
+        stats_[i] = CacheStats();
+    }
+}
+
+void BufferPool::Trim()
+{
+    std::lock_guard lock(mutex_);
+    idle_bytes_ = 0;
+    for (size_t i = 0; i < kKindCount; ++i)
+    {
+        bytes_[i].clear();
+        images_[i].clear();
+    }
+}
+
+void BufferPool::TrimTo(int64_t max_bytes)
+{
+    std::lock_guard lock(mutex_);
+    EvictLocked(max_bytes, 0);
+}
+
+void BufferPool::EvictLocked(int64_t max_bytes, size_t first)
+{
+    for (size_t n = 0; n < kKindCount && idle_bytes_ > max_bytes; ++n)
+    {
+        const size_t i = (first + n) % kKindCount;
+        auto & bytes = bytes_[i];
+        while (idle_bytes_ > max_bytes && !bytes.empty())
+        {
+            idle_bytes_ -= bytes.front().capacity();
+            bytes.erase(bytes.begin());
+        }
+        auto & images = images_[i];
+        while (idle_bytes_ > max_bytes && !images.empty())
+        {
+            idle_bytes_ -= images.front().sizeInBytes();
+            images.erase(images.begin());
+        }
+    }
+}
+
+bool BufferPool::MakeRoomLocked(int64_t bytes, size_t index)
+{
+    if (budget_ == nullptr)
+        return true;
+    const int64_t available = budget_->Available();
+    if (bytes > available)
+        return false;
+    EvictLocked(available - bytes, index);
+    return true;
+}
+
+QByteArray BufferPool::AcquireBytes(PoolKind kind, qsizetype size, qsizetype reserve)
+{
+    const size_t index = static_cast<size_t>(kind);
+    const qsizetype need = std::max(size, reserve);
+    QByteArray bytes;
+    {
+        std::lock_guard lock(mutex_);
+        // 选择容量足够的缓冲中最小的一个
+        auto & pool = bytes_[index];
+        auto best = pool.end();
+        for (auto it = pool.begin(); it != pool.end(); ++it)
+        {
+            if (it->capacity() >= need && (best == pool.end() || it->capacity() < best->capacity()))
+                best = it;
+        }
+        if (best != pool.end())
+        {
+            bytes = std::move(*best);
+            pool.erase(best);
+            idle_bytes_ -= bytes.capacity();
+            ++stats_[index].hits;
+        }
+        else
+        {
+            ++stats_[index].misses;
+        }
+    }
+    if (bytes.capacity() < need)
+        bytes.reserve(need);
+    // 长度不超过容量时 resize 不会重新分配
+    bytes.resize(size);
+    return bytes;
+}
+
+void BufferPool::ReleaseBytes(PoolKind kind, QByteArray bytes)
+{
+    if (!bytes.isDetached() || bytes.capacity() <= 0)
+        return;
+    const size_t index = static_cast<size_t>(kind);
+    std::lock_guard lock(mutex_);
+    auto & pool = bytes_[index];
+    if (max_items_ == 0 || !MakeRoomLocked(bytes.capacity(), index))
+        return;
+    // 超过数量时丢弃最早放回的
+    if (pool.size() >= max_items_)
+    {
+        idle_bytes_ -= pool.front().capacity();
+        pool.erase(pool.begin());
+    }
+    idle_bytes_ += bytes.capacity();
+    pool.push_back(std::move(bytes));
+}
+
+QImage BufferPool::AcquireImage(PoolKind kind, const QSize & size, QImage::Format format)
+{
+    const size_t index = static_cast<size_t>(kind);
+    {
+        std::lock_guard lock(mutex_);
+        auto & pool = images_[index];
+        auto found = std::find_if(pool.begin(), pool.end(), [&](const QImage & image)
+                                  { return image.size() == size && image.format() == format; });
+        if (found != pool.end())
+        {
+            QImage image = std::move(*found);
+            pool.erase(found);
+            idle_bytes_ -= image.sizeInBytes();
+            ++stats_[index].hits;
+            return image;
+        }
+        // 尺寸变了, 之前的图片很可能不会再用到, 不等到数量超出再丢弃
+        for (const QImage & image : pool)
+            idle_bytes_ -= image.sizeInBytes();
+        pool.clear();
+        ++stats_[index].misses;
+    }
+    return QImage(size, format);
+}
+
+void BufferPool::ReleaseImage(PoolKind kind, QImage image)
+{
+    if (!image.isDetached())
+        return;
+    const size_t index = static_cast<size_t>(kind);
+    std::lock_guard lock(mutex_);
+    auto & pool = images_[index];
+    if (max_items_ == 0 || !MakeRoomLocked(image.sizeInBytes(), index))
+        return;
+    if (pool.size() >= max_items_)
+    {
+        idle_bytes_ -= pool.front().sizeInBytes();
+        pool.erase(pool.begin());
+    }
+    idle_bytes_ += image.sizeInBytes();
+    pool.push_back(std::move(image));
+}
+
+CacheStats BufferPool::Stats(PoolKind kind) const
+{
+    std::lock_guard lock(mutex_);
+    return stats_[static_cast<size_t>(kind)];
+}
+
+const char * BufferPool::KindName(PoolKind kind)
+{
+    switch (kind)
+    {
+    case PoolKind::kInput:
+        return "input";
+    case PoolKind::kDecode:
+        return "decode";
+    case PoolKind::kCanvas:
+        return "canvas";
+    case PoolKind::kEncode:
+        return "encode";
+    default:
+        return "";
+    }
+}
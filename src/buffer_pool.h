@@ -0,0 +1,69 @@
+﻿#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+
+#include "memory_budget.h"
+#include "render_cache.h"
+
+using PoolKind = enum class PoolKind
+{
+    kInput, // 读取的文件内容
+    kDecode, // 解码结果
+    kCanvas, // 输出画布
+    kEncode, // 编码结果
+    kCount,
+};
+
+// 在图片之间复用大块内存, 同一批图片的尺寸通常相同, 稳定后几乎不再分配
+// 缓冲在一个阶段取出, 在后面的阶段由其他线程归还, 所以所有工作线程共享一个池
+// 空闲缓冲不属于任何图片, 设置了 budget 时所有空闲缓冲的总字节数不超过预算的剩余部分
+class BufferPool
+{
+public:
+    // 每种缓冲最多保留 max_items 个空闲的, 同时清空已有的缓冲与统计
+    void Reset(size_t max_items, const MemoryBudget * budget = nullptr);
+
+    // 释放空闲的缓冲, 保留统计
+    void Trim();
+
+    // 从最早放回的开始释放, 直到空闲缓冲不超过 max_bytes
+    void TrimTo(int64_t max_bytes);
+
+    // 返回的长度为 size, 容量至少为 max(size, reserve), 内容未初始化
+    QByteArray AcquireBytes(PoolKind kind, qsizetype size, qsizetype reserve = 0);
+
+    // 仍被其他对象共享的缓冲直接释放
+    void ReleaseBytes(PoolKind kind, QByteArray bytes);
+
+    // 内容未初始化, 分配失败时返回空图
+    QImage AcquireImage(PoolKind kind, const QSize & size, QImage::Format format);
+
+    void ReleaseImage(PoolKind kind, QImage image);
+
+    CacheStats Stats(PoolKind kind) const;
+
+    static const char * KindName(PoolKind kind);
+
+private:
+    static constexpr size_t kKindCount = static_cast<size_t>(PoolKind::kCount);
+
+    // 调用时持有 mutex_, 先释放 first 种类的缓冲
+    void EvictLocked(int64_t max_bytes, size_t first);
+
+    // 调用时持有 mutex_, 放回 bytes 个字节后仍在预算内时返回 true
+    bool MakeRoomLocked(int64_t bytes, size_t index);
+
+    mutable std::mutex mutex_;
+    size_t max_items_ = 0;
+    const MemoryBudget * budget_ = nullptr;
+    int64_t idle_bytes_ = 0;
+    std::array<std::vector<QByteArray>, kKindCount> bytes_;
+    std::array<std::vector<QImage>, kKindCount> images_;
+    std::array<CacheStats, kKindCount> stats_ = { };
+};
@@ -0,0 +1,87 @@
+﻿#include "checkpoint.h"
+
+#include <QDebug>
+
+namespace
+{
+// 第一行为 "photo_watermark checkpoint <参数哈希>", 之后每行一个相对路径
+const QByteArray kHeader = "photo_watermark checkpoint ";
+}
+
+bool Checkpoint::Open(const std::filesystem::path & output_dir, const QByteArray & param_hash, bool resume)
+{
+    std::lock_guard lock(mutex_);
+    file_.close();
+    done_.clear();
+
+    const std::string path = (output_dir / kFileName).string();
+    file_.setFileName(QString::fromLocal8Bit(path.data(), static_cast<qsizetype>(path.size())));
+    const QByteArray header = kHeader + param_hash;
+    if (resume && file_.open(QIODevice::ReadOnly))
+    {
+        if (file_.readLine().trimmed() == header)
+        {
+            while (!file_.atEnd())
+            {
+                const QByteArray line = file_.readLine().trimmed();
+                if (!line.isEmpty())
+                    done_.insert(line.toStdString());
+            }
+        }
+        else
+        {
+            qWarning() << "Checkpoint" << file_.fileName() << "was written with other settings, start over.";
+        }
+        file_.close();
+    }
+
+    // 没有可用的记录时重写文件头
+    const QIODevice::OpenMode mode = done_.empty() ? QIODevice::WriteOnly | QIODevice::Truncate
+                                                   : QIODevice::WriteOnly | QIODevice::Append;
+    if (!file_.open(mode) || (done_.empty() && (file_.write(header + '\n') < 0 || !file_.flush())))
+    {
+        qWarning() << "Open checkpoint" << file_.fileName() << "failed.";
+        file_.close();
+        return false;
+    }
+    return true;
+}
+
+bool Checkpoint::Contains(const std::string & key) const
+{
+    std::lock_guard lock(mutex_);
+    return done_.contains(key);
+}
+
+size_t Checkpoint::Size() const
+{
+    std::lock_guard lock(mutex_);
+    return done_.size();
+}
+
+void Checkpoint::Add(const std::string & key)
+{
+    std::lock_guard lock(mutex_);
+    // 没有打开检查点时 (dry run, 打开失败, 分布式分块) 不记录, 避免集合随处理的图片一直增长
+    if (!file_.isOpen() || !done_.insert(key).second)
+        return;
+    // 进程被结束时最多丢失正在写入的一行
+    if (file_.write(QByteArray::fromStdString(key) + '\n') < 0 || !file_.flush())
+        qWarning() << "Write checkpoint" << file_.fileName() << "failed.";
+}
+
+void Checkpoint::Close()
+{
+    std::lock_guard lock(mutex_);
+    file_.close();
+    done_.clear();
+}
+
+void Checkpoint::Remove()
+{
+    std::lock_guard lock(mutex_);
+    file_.close();
+    done_.clear();
+    if (!file_.fileName().isEmpty() && file_.exists() && !file_.remove())
+        qWarning() << "Remove checkpoint" << file_.fileName() << "failed.";
+}
@@ -0,0 +1,35 @@
+﻿#pragma once
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <QByteArray>
+#include <QFile>
+
+// 输出目录中的检查点, 每写完一张图片追加一行相对路径并立即刷新
+// 正常结束时删除, 取消或进程中断后可以从检查点继续, 跳过已经完成的图片
+class Checkpoint
+{
+public:
+    static constexpr const char * kFileName = ".photo_watermark_checkpoint";
+
+    // resume 时读取已有的记录, 参数不同时丢弃; 否则重新开始
+    bool Open(const std::filesystem::path & output_dir, const QByteArray & param_hash, bool resume);
+
+    bool Contains(const std::string & key) const;
+
+    size_t Size() const;
+
+    void Add(const std::string & key);
+
+    // 保留文件, 下次可以继续
+    void Close();
+
+    // 处理完成后删除文件
+    void Remove();
+
+private:
+    mutable std::mutex mutex_;
+    QFile file_;
+    std::unordered_set<std::string> done_;
+};
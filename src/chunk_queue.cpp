@@ -0,0 +1,373 @@
+﻿#include "chunk_queue.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <functional>
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+namespace
+{
+// 第一行为 "photo_watermark job <参数哈希>", 第二行为分块数量
+const QByteArray kJobHeader = "photo_watermark job ";
+constexpr char kJobFile[] = "job";
+constexpr char kChunksDir[] = "chunks";
+constexpr char kLeasesDir[] = "leases";
+constexpr char kDoneDir[] = "done";
+
+QString ToQString(const std::filesystem::path & path)
+{
+    const std::string name = path.string();
+    return QString::fromLocal8Bit(name.data(), static_cast<qsizetype>(name.size()));
+}
+
+std::string ChunkName(int index)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "%06d", index);
+    return name;
+}
+
+int64_t NowMs()
+{
+    return QDateTime::currentMSecsSinceEpoch();
+}
+
+bool ReadFile(const std::filesystem::path & path, QByteArray & data)
+{
+    QFile file(ToQString(path));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    data = file.readAll();
+    return true;
+}
+
+// 写入临时文件后改名替换, 其他节点不会读到写了一半的内容
+bool WriteFile(const std::filesystem::path & path, const QByteArray & data)
+{
+    QSaveFile file(ToQString(path));
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size() || !file.commit())
+    {
+        qWarning() << "Write" << file.fileName() << "failed.";
+        return false;
+    }
+    return true;
+}
+}
+
+bool ChunkQueue::Create(const std::filesystem::path & dir, const std::vector<std::string> & files, int chunk_size,
+                        const QByteArray & param_hash)
+{
+    dir_ = dir;
+    if (JobExists(dir_))
+    {
+        if (!ReadJob(param_hash))
+            return false;
+        qInfo() << "Continue job in" << ToQString(dir_) << "with" << chunk_count_ << "chunks.";
+        return true;
+    }
+
+    std::error_code ec;
+    for (const char * sub_dir : { kChunksDir, kLeasesDir, kDoneDir })
+    {
+        std::filesystem::create_directories(dir_ / sub_dir, ec);
+        if (ec)
+        {
+            qWarning() << "Create directory" << ToQString(dir_ / sub_dir) << "failed:" << ec.message().c_str();
+            return false;
+        }
+    }
+
+    const size_t size = static_cast<size_t>(std::max(chunk_size, 1));
+    chunk_count_ = static_cast<int>((files.size() + size - 1) / size);
+    done_.assign(static_cast<size_t>(chunk_count_), 0);
+    lease_expire_.assign(static_cast<size_t>(chunk_count_), 0);
+    for (int index = 0; index < chunk_count_; ++index)
+    {
+        QByteArray data;
+        const size_t end = std::min(files.size(), (index + 1) * size);
+        for (size_t i = index * size; i < end; ++i)
+            data += QByteArray::fromStdString(files[i]) + '\n';
+        if (!WriteFile(ChunkPath(index), data))
+            return false;
+    }
+    // 分块全部写完后才写入 job, 工作节点看到 job 时分块一定完整
+    return WriteFile(dir_ / kJobFile, kJobHeader + param_hash + '\n' + QByteArray::number(chunk_count_) + '\n');
+}
+
+bool ChunkQueue::JobExists(const std::filesystem::path & dir)
+{
+    return std::filesystem::exists(dir / kJobFile);
+}
+
+bool ChunkQueue::Open(const std::filesystem::path & dir, const QByteArray & param_hash, const std::string & worker_id,
+                      int lease_seconds)
+{
+    dir_ = dir;
+    worker_id_ = worker_id;
+    lease_ms_ = static_cast<int64_t>(std::max(lease_seconds, 1)) * 1000;
+    if (!ReadJob(param_hash))
+        return false;
+    // 不同节点从不同的位置开始查找, 减少同时争抢同一个分块
+    if (chunk_count_ > 0)
+        next_start_ = static_cast<int>(std::hash<std::string>{ }(worker_id_) % static_cast<size_t>(chunk_count_));
+    return true;
+}
+
+bool ChunkQueue::ReadJob(const QByteArray & param_hash)
+{
+    QByteArray data;
+    if (!ReadFile(dir_ / kJobFile, data))
+        return false;
+    const QList<QByteArray> lines = data.split('\n');
+    if (lines.size() < 2 || lines[0] != kJobHeader + param_hash)
+    {
+        qWarning() << "Job in" << ToQString(dir_) << "was created with other settings.";
+        return false;
+    }
+    bool ok = false;
+    chunk_count_ = lines[1].toInt(&ok);
+    if (!ok || chunk_count_ < 0)
+        return false;
+    done_.assign(static_cast<size_t>(chunk_count_), 0);
+    lease_expire_.assign(static_cast<size_t>(chunk_count_), 0);
+    done_count_ = 0;
+    done_images_ = 0;
+    done_failed_ = 0;
+    return true;
+}
+
+bool ChunkQueue::Claim(Chunk & chunk)
+{
+    if (chunk_count_ <= 0)
+        return false;
+    RefreshDone();
+    const int64_t now = NowMs();
+    for (int i = 0; i < chunk_count_; ++i)
+    {
+        const int index = (next_start_ + i) % chunk_count_;
+        if (done_[index] || lease_expire_[index] > now)
+            continue;
+        if (!TryLease(index) && !(ReclaimExpired(index) && TryLease(index)))
+            continue;
+        next_start_ = (index + 1) % chunk_count_;
+        // 上一个持有者可能在租约过期后才完成
+        if (IsDone(index))
+        {
+            Release(index);
+            continue;
+        }
+        // 分块文件读不出来时记为一次失败并标记完成, 否则所有节点都会一直等待这个分块
+        if (!LoadChunk(index, chunk))
+        {
+            Complete(index, 0, 1);
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool ChunkQueue::Renew(int index)
+{
+    const std::filesystem::path path = LeasePath(index);
+    Lease lease;
+    if (!ReadLease(path, lease) || lease.worker_id != worker_id_)
+    {
+        qWarning() << "Lease of chunk" << index << "was taken by" << lease.worker_id.c_str();
+        return false;
+    }
+    // 读取之后租约仍可能被收回并重新领取, 改名只有一个节点能成功, 改名后再确认一次持有者
+    const std::filesystem::path held = path.string() + "." + worker_id_ + ".renew";
+    if (!QFile::rename(ToQString(path), ToQString(held)))
+    {
+        qWarning() << "Lease of chunk" << index << "was reclaimed.";
+        return false;
+    }
+    if (!ReadLease(held, lease) || lease.worker_id != worker_id_)
+    {
+        qWarning() << "Lease of chunk" << index << "was taken by" << lease.worker_id.c_str();
+        QFile::rename(ToQString(held), ToQString(path));
+        QFile::remove(ToQString(held));
+        return false;
+    }
+    // 改名回去时目标已经存在说明租约不在期间有节点新领取了这个分块, 让给对方
+    if (!WriteFile(held, LeaseData()) || !QFile::rename(ToQString(held), ToQString(path)))
+    {
+        qWarning() << "Lease of chunk" << index << "was lost while renewing.";
+        QFile::remove(ToQString(held));
+        return false;
+    }
+    return true;
+}
+
+bool ChunkQueue::Complete(int index, int images, int failed)
+{
+    const QByteArray data = QByteArray::number(images) + ' ' + QByteArray::number(failed) + ' ' +
+        QByteArray::fromStdString(worker_id_) + '\n';
+    if (!WriteFile(DonePath(index), data))
+        return false;
+    Release(index);
+    return true;
+}
+
+void ChunkQueue::Release(int index)
+{
+    Lease lease;
+    if (ReadLease(LeasePath(index), lease) && lease.worker_id == worker_id_)
+        QFile::remove(ToQString(LeasePath(index)));
+}
+
+int ChunkQueue::ChunkCount() const
+{
+    return chunk_count_;
+}
+
+int ChunkQueue::DoneCount(int * images, int * failed)
+{
+    RefreshDone();
+    if (images)
+        *images += done_images_;
+    if (failed)
+        *failed += done_failed_;
+    return done_count_;
+}
+
+void ChunkQueue::RefreshDone()
+{
+    if (done_count_ >= chunk_count_)
+        return;
+    std::error_code ec;
+    for (const auto & entry : std::filesystem::directory_iterator(dir_ / kDoneDir, ec))
+    {
+        // 跳过 QSaveFile 的临时文件
+        const std::string name = entry.path().filename().string();
+        int index = -1;
+        const auto [end, error] = std::from_chars(name.data(), name.data() + name.size(), index);
+        if (error != std::errc() || end != name.data() + name.size() || index < 0 || index >= chunk_count_ ||
+            done_[index])
+            continue;
+        QByteArray data;
+        if (!ReadFile(entry.path(), data))
+            continue;
+        done_[index] = 1;
+        ++done_count_;
+        const QList<QByteArray> fields = data.trimmed().split(' ');
+        if (!fields.isEmpty())
+            done_images_ += fields[0].toInt();
+        if (fields.size() > 1)
+            done_failed_ += fields[1].toInt();
+    }
+}
+
+std::filesystem::path ChunkQueue::ChunkPath(int index) const
+{
+    return dir_ / kChunksDir / ChunkName(index);
+}
+
+std::filesystem::path ChunkQueue::LeasePath(int index) const
+{
+    return dir_ / kLeasesDir / ChunkName(index);
+}
+
+std::filesystem::path ChunkQueue::DonePath(int index) const
+{
+    return dir_ / kDoneDir / ChunkName(index);
+}
+
+bool ChunkQueue::IsDone(int index) const
+{
+    return std::filesystem::exists(DonePath(index));
+}
+
+bool ChunkQueue::TryLease(int index)
+{
+    // NewOnly 对应 O_EXCL, 文件已经存在时失败
+    QFile file(ToQString(LeasePath(index)));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::NewOnly))
+        return false;
+    const QByteArray data = LeaseData();
+    const bool ok = file.write(data) == data.size() && file.flush();
+    file.close();
+    if (!ok)
+        file.remove();
+    return ok;
+}
+
+bool ChunkQueue::ReclaimExpired(int index)
+{
+    const std::filesystem::path path = LeasePath(index);
+    Lease lease;
+    if (ReadLease(path, lease))
+    {
+        if (lease.expire_ms > NowMs())
+        {
+            lease_expire_[index] = lease.expire_ms;
+            return false;
+        }
+    }
+    else
+    {
+        // 刚创建还没有写入内容, 或者持有者在写入前退出; 不存在时可能正在续期
+        const QFileInfo info(ToQString(path));
+        if (!info.exists() || info.lastModified().toMSecsSinceEpoch() + lease_ms_ > NowMs())
+            return false;
+    }
+
+    // 改名只有一个节点能成功, 之后再确认收回的确实是过期的那份租约
+    const std::filesystem::path stale = path.string() + "." + worker_id_ + ".stale";
+    if (!QFile::rename(ToQString(path), ToQString(stale)))
+        return false;
+    Lease taken;
+    if (ReadLease(stale, taken) && (taken.worker_id != lease.worker_id || taken.expire_ms != lease.expire_ms))
+    {
+        // 读取之后租约被续期或重新领取了, 放回原处; 原处已经有新的租约时对方在续期时会发现
+        QFile::rename(ToQString(stale), ToQString(path));
+        QFile::remove(ToQString(stale));
+        return false;
+    }
+    QFile::remove(ToQString(stale));
+    qInfo() << "Reclaim chunk" << index << "from" << lease.worker_id.c_str();
+    return true;
+}
+
+bool ChunkQueue::ReadLease(const std::filesystem::path & path, Lease & lease) const
+{
+    QByteArray data;
+    if (!ReadFile(path, data))
+        return false;
+    const QList<QByteArray> lines = data.split('\n');
+    if (lines.size() < 2)
+        return false;
+    bool ok = false;
+    lease.worker_id = lines[0].toStdString();
+    lease.expire_ms = lines[1].toLongLong(&ok);
+    return ok && !lease.worker_id.empty();
+}
+
+QByteArray ChunkQueue::LeaseData() const
+{
+    return QByteArray::fromStdString(worker_id_) + '\n' + QByteArray::number(NowMs() + lease_ms_) + '\n';
+}
+
+bool ChunkQueue::LoadChunk(int index, Chunk & chunk) const
+{
+    QByteArray data;
+    if (!ReadFile(ChunkPath(index), data))
+    {
+        qWarning() << "Read chunk" << index << "failed.";
+        return false;
+    }
+    chunk.index = index;
+    chunk.files.clear();
+    for (const QByteArray & line : data.split('\n'))
+    {
+        if (!line.isEmpty())
+            chunk.files.push_back(line.toStdString());
+    }
+    return true;
+}
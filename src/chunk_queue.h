@@ -0,0 +1,98 @@
+﻿#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <QByteArray>
+
+// 多个节点通过共享目录 (如网络文件系统) 分配图片, 不需要其他服务
+// 目录结构:
+//   job        参数哈希与分块数量, 协调者在分块全部写完后最后写入
+//   chunks/N   每行一个相对 input_path 的路径
+//   leases/N   持有者与到期时间, 以 NewOnly 创建保证同一时刻只有一个节点领取成功
+//              续期时临时改名为 N.<worker>.renew, 节点在续期中退出时分块可以立即被领取
+//   done/N     分块已经完成, 内容为处理数与失败数
+// 租约过期的分块由其他节点改名收回后重新领取, 同一张图片可能被处理不止一次, 输出相同
+// 各节点的时钟误差需要远小于租约时长
+// 已完成的分块与别人租约的到期时间记在本地, 每次查找只列一次 done 目录, 不再逐个读取
+class ChunkQueue
+{
+public:
+    using Chunk = struct Chunk
+    {
+        int index = -1;
+        std::vector<std::string> files;
+    };
+
+    // 协调者: 把输入分块写入 dir, 已经存在相同参数的任务时继续使用
+    bool Create(const std::filesystem::path & dir, const std::vector<std::string> & files, int chunk_size,
+                const QByteArray & param_hash);
+
+    // 协调者是否已经写完分块
+    static bool JobExists(const std::filesystem::path & dir);
+
+    // 工作节点: 任务还没有创建或参数不同时返回 false
+    bool Open(const std::filesystem::path & dir, const QByteArray & param_hash, const std::string & worker_id,
+              int lease_seconds);
+
+    // 领取一个没有完成且没有有效租约的分块, 没有可以领取的时返回 false
+    bool Claim(Chunk & chunk);
+
+    // 延长租约, 租约已经被其他节点收回时返回 false
+    // 先把租约改名为自己的临时文件再确认持有者, 暂停后恢复的节点不会覆盖别人刚领取的租约
+    bool Renew(int index);
+
+    // 写入完成标记后释放租约
+    bool Complete(int index, int images, int failed);
+
+    // 放弃分块, 其他节点可以立即领取
+    void Release(int index);
+
+    int ChunkCount() const;
+
+    // 已完成的分块数与其中的图片数、失败数
+    int DoneCount(int * images = nullptr, int * failed = nullptr);
+
+private:
+    using Lease = struct Lease
+    {
+        std::string worker_id;
+        int64_t expire_ms = 0;
+    };
+
+    std::filesystem::path ChunkPath(int index) const;
+
+    std::filesystem::path LeasePath(int index) const;
+
+    std::filesystem::path DonePath(int index) const;
+
+    bool ReadJob(const QByteArray & param_hash);
+
+    // 列出 done 目录, 只读取新出现的完成标记
+    void RefreshDone();
+
+    bool IsDone(int index) const;
+
+    bool TryLease(int index);
+
+    // 租约过期时改名收回, 收回成功后可以重新 TryLease
+    bool ReclaimExpired(int index);
+
+    bool ReadLease(const std::filesystem::path & path, Lease & lease) const;
+
+    QByteArray LeaseData() const;
+
+    bool LoadChunk(int index, Chunk & chunk) const;
+
+    std::filesystem::path dir_;
+    std::string worker_id_;
+    int64_t lease_ms_ = 0;
+    int chunk_count_ = 0;
+    int next_start_ = 0; // 下一次查找的起点, 领取后移到下一个分块
+
+    std::vector<char> done_; // 下标为分块
+    int done_count_ = 0;
+    int done_images_ = 0;
+    int done_failed_ = 0;
+    std::vector<int64_t> lease_expire_; // 其他节点租约的到期时间, 到期前不再读取
+};
@@ -0,0 +1,561 @@
+﻿#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <thread>
+#include <QCommandLineParser>
+#include <QFileInfo>
+#include <QGuiApplication>
+#include <QSettings>
+#include <QSysInfo>
+
+#include "chunk_queue.h"
+#include "photo_watermark.h"
+
+namespace
+{
+enum ExitCode
+{
+    kExitSuccess = 0,
+    kExitBadArguments = 1,
+    kExitInitFailed = 2,
+    kExitImagesFailed = 3,
+    kExitCancelled = 4,
+};
+
+volatile std::sig_atomic_t interrupted = 0;
+
+// 第一次 Ctrl+C 取消处理并保存检查点, 第二次直接结束进程
+void OnInterrupt(int)
+{
+    interrupted = 1;
+    std::signal(SIGINT, SIG_DFL);
+}
+
+// 与 gui 中下拉框的顺序一致
+const QStringList text_type_names = {
+    QStringLiteral("none"),
+    QStringLiteral("model"),
+    QStringLiteral("lens"),
+    QStringLiteral("exposure"),
+    QStringLiteral("date"),
+    QStringLiteral("gps"),
+    QStringLiteral("custom"),
+    QStringLiteral("rich")
+};
+
+// 与 ChromaSubsampling 的顺序一致
+const QStringList subsampling_names = {
+    QStringLiteral("default"),
+    QStringLiteral("444"),
+    QStringLiteral("422"),
+    QStringLiteral("420")
+};
+
+const QStringList font_weight_names = {
+    QStringLiteral("thin"),
+    QStringLiteral("extralight"),
+    QStringLiteral("light"),
+    QStringLiteral("normal"),
+    QStringLiteral("medium"),
+    QStringLiteral("demibold"),
+    QStringLiteral("bold"),
+    QStringLiteral("extrabold"),
+    QStringLiteral("black")
+};
+
+using SlotOption = struct SlotOption
+{
+    TextPosition position;
+    QString name;
+    TextType default_type;
+    int default_weight;
+};
+
+// 默认值与 gui 的初始配置一致
+const SlotOption slot_options[] = {
+    { TextPosition::kLeftTop, QStringLiteral("lt"), TextType::kModel, 600 },
+    { TextPosition::kLeftBottom, QStringLiteral("lb"), TextType::kLensModel, 300 },
+    { TextPosition::kRightTop, QStringLiteral("rt"), TextType::kExposureParam, 600 },
+    { TextPosition::kRightBottom, QStringLiteral("rb"), TextType::kData, 300 },
+};
+
+// 命令行优先, 其次是配置文件, 都没有时使用默认值
+class Options
+{
+public:
+    Options(const QCommandLineParser & parser, const QSettings * settings) : parser_(parser), settings_(settings) { }
+
+    QString Value(const QString & name, const QString & default_value = QString()) const
+    {
+        if (parser_.isSet(name))
+            return parser_.value(name);
+        if (settings_ && settings_->contains(name))
+            return settings_->value(name).toString();
+        return default_value;
+    }
+
+    // 可以重复的参数, 配置文件中用逗号分隔
+    QStringList Values(const QString & name) const
+    {
+        if (parser_.isSet(name))
+            return parser_.values(name);
+        if (settings_ && settings_->contains(name))
+            return settings_->value(name).toStringList();
+        return { };
+    }
+
+    // 命令行上的开关只能打开, 配置文件中可以写 true/false
+    bool Flag(const QString & name, bool default_value) const
+    {
+        if (parser_.isSet(name))
+            return true;
+        if (settings_ && settings_->contains(name))
+            return settings_->value(name).toBool();
+        return default_value;
+    }
+
+private:
+    const QCommandLineParser & parser_;
+    const QSettings * settings_;
+};
+
+bool ParseTextType(const QString & value, TextType & type)
+{
+    const auto index = text_type_names.indexOf(value.toLower());
+    if (index < 0)
+        return false;
+    type = static_cast<TextType>(index);
+    return true;
+}
+
+bool ParseWeight(const QString & value, int & weight)
+{
+    const auto index = font_weight_names.indexOf(value.toLower());
+    if (index >= 0)
+    {
+        weight = static_cast<int>(index + 1) * 100;
+        return true;
+    }
+    bool ok = false;
+    weight = value.toInt(&ok);
+    return ok && weight > 0;
+}
+
+bool ParseNumber(const Options & options, const QString & name, int & value)
+{
+    const QString text = options.Value(name);
+    if (text.isEmpty())
+        return true;
+    bool ok = false;
+    value = text.toInt(&ok);
+    if (!ok)
+        fprintf(stderr, "Invalid value for --%s: %s\n", qPrintable(name), qPrintable(text));
+    return ok;
+}
+
+// dir:long_edge[:quality[:format]], dir 为 . 时直接输出到输出目录
+bool ParseRendition(const QString & text, Rendition & rendition)
+{
+    const QStringList parts = text.trimmed().split(QChar(':'));
+    if (parts.size() < 2 || parts.size() > 4 || parts[0].isEmpty())
+        return false;
+    if (parts[0] != QStringLiteral("."))
+        rendition.dir = parts[0].toStdString();
+    bool ok = false;
+    rendition.long_edge = parts[1].toInt(&ok);
+    if (!ok || rendition.long_edge < 0)
+        return false;
+    if (parts.size() > 2)
+    {
+        rendition.quality = parts[2].toInt(&ok);
+        if (!ok)
+            return false;
+    }
+    if (parts.size() > 3)
+        rendition.format = parts[3].toLower().toStdString();
+    return true;
+}
+
+bool BuildParam(const Options & options, WaterMarkParam & p)
+{
+    p.input_path = options.Value(QStringLiteral("input")).toStdString();
+    p.output_path = options.Value(QStringLiteral("output")).toStdString();
+    p.font = QFont(options.Value(QStringLiteral("font"), QStringLiteral("MiSans Latin")));
+    p.logo = options.Value(QStringLiteral("logo"), QStringLiteral("Auto")).toStdString();
+    p.add_frame = !options.Flag(QStringLiteral("no-frame"), false);
+    p.auto_align = options.Flag(QStringLiteral("auto-align"), false);
+    p.use_mmap = !options.Flag(QStringLiteral("no-mmap"), false);
+    p.dry_run = options.Flag(QStringLiteral("dry-run"), false);
+    p.lossless = options.Flag(QStringLiteral("lossless"), false);
+    p.incremental = !options.Flag(QStringLiteral("no-incremental"), false);
+    p.recursive = !options.Flag(QStringLiteral("no-recursive"), false);
+    p.resume = options.Flag(QStringLiteral("resume"), false);
+    p.metrics_path = options.Value(QStringLiteral("metrics")).toStdString();
+
+    bool ok = false;
+    const QString ratio = options.Value(QStringLiteral("border-ratio"), QStringLiteral("0.02"));
+    p.border_ratio = ratio.toDouble(&ok);
+    if (!ok || p.border_ratio <= 0)
+    {
+        fprintf(stderr, "Invalid value for --border-ratio: %s\n", qPrintable(ratio));
+        return false;
+    }
+    if (!ParseNumber(options, QStringLiteral("threads"), p.thread_count) ||
+        !ParseNumber(options, QStringLiteral("queue"), p.queue_capacity))
+        return false;
+    int memory_budget_mib = 0;
+    if (!ParseNumber(options, QStringLiteral("memory-budget"), memory_budget_mib))
+        return false;
+    p.memory_budget = static_cast<int64_t>(std::max(memory_budget_mib, 0)) * 1024 * 1024;
+    // 编码参数作用于所有输出, --rendition 中的 quality 优先
+    Rendition base;
+    if (!ParseNumber(options, QStringLiteral("quality"), base.quality))
+        return false;
+    const QString subsampling = options.Value(QStringLiteral("subsampling"), QStringLiteral("default"));
+    const auto subsampling_index = subsampling_names.indexOf(subsampling.toLower());
+    if (subsampling_index < 0)
+    {
+        fprintf(stderr, "Invalid value for --subsampling: %s\n", qPrintable(subsampling));
+        return false;
+    }
+    base.subsampling = static_cast<ChromaSubsampling>(subsampling_index);
+    base.progressive = options.Flag(QStringLiteral("progressive"), false);
+    base.optimize_huffman = options.Flag(QStringLiteral("optimize-huffman"), false);
+    base.fast_encode = options.Flag(QStringLiteral("fast-encode"), false);
+
+    for (const auto & text : options.Values(QStringLiteral("rendition")))
+    {
+        Rendition rendition = base;
+        if (!ParseRendition(text, rendition))
+        {
+            fprintf(stderr, "Invalid value for --rendition: %s\n", qPrintable(text));
+            return false;
+        }
+        p.renditions.push_back(std::move(rendition));
+    }
+    if (p.renditions.empty())
+        p.renditions.push_back(base);
+
+    for (const auto & slot : slot_options)
+    {
+        auto & setting = p.text_settings[slot.position];
+        setting.text_type = slot.default_type;
+        setting.weight = slot.default_weight;
+
+        const QString type = options.Value(slot.name);
+        if (!type.isEmpty() && !ParseTextType(type, setting.text_type))
+        {
+            fprintf(stderr, "Invalid text type for --%s: %s\n", qPrintable(slot.name), qPrintable(type));
+            return false;
+        }
+        const QString weight = options.Value(slot.name + QStringLiteral("-weight"));
+        if (!weight.isEmpty() && !ParseWeight(weight, setting.weight))
+        {
+            fprintf(stderr, "Invalid font weight for --%s-weight: %s\n", qPrintable(slot.name), qPrintable(weight));
+            return false;
+        }
+        if (setting.text_type == TextType::kCustomString || setting.text_type == TextType::KRichText)
+            setting.custom_data = options.Value(slot.name + QStringLiteral("-text"));
+    }
+    return true;
+}
+
+// 等待处理结束, Ctrl+C 时取消; poll 每 100ms 调用一次, 返回 false 时同样取消
+void WaitWork(PhotoWaterMarkWork & work, const std::function<bool()> & poll = nullptr)
+{
+    // 信号处理函数中只设置标记, 由这个线程取消
+    std::atomic_bool finished = false;
+    std::thread watcher([&work, &finished, &poll]
+    {
+        while (!finished)
+        {
+            if (interrupted || (poll && !poll()))
+            {
+                work.Cancel();
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    });
+    work.Wait();
+    finished = true;
+    watcher.join();
+}
+
+// 扫描输入并分块写入共享目录, 之后等待所有分块完成
+int RunCoordinator(const WaterMarkParam & p, const std::filesystem::path & dir, int chunk_size, bool quiet)
+{
+    PhotoWaterMarkWork work;
+    if (!work.Init(p, nullptr))
+        return kExitInitFailed;
+    const std::vector<std::string> files = work.ListInputs();
+    ChunkQueue queue;
+    if (!queue.Create(dir, files, chunk_size, PhotoWaterMarkWork::HashParam(p)))
+        return kExitInitFailed;
+    if (!quiet)
+        fprintf(stderr, "%zu images in %d chunks, waiting for workers.\n", files.size(), queue.ChunkCount());
+
+    int images = 0;
+    int failed = 0;
+    for (int last_done = -1;;)
+    {
+        images = 0;
+        failed = 0;
+        const int done = queue.DoneCount(&images, &failed);
+        if (!quiet && done != last_done)
+            fprintf(stderr, "\rChunks: %d/%d images: %d failed: %d", done, queue.ChunkCount(), images, failed);
+        last_done = done;
+        if (done >= queue.ChunkCount())
+            break;
+        if (interrupted)
+        {
+            fprintf(stderr, "\nStop waiting, workers keep processing the job.\n");
+            return kExitCancelled;
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    if (!quiet)
+        fprintf(stderr, "\nDone: %d images, %d failed.\n", images, failed);
+    return failed > 0 ? kExitImagesFailed : kExitSuccess;
+}
+
+// 依次领取分块处理, 处理中按租约时长的 1/3 续期, 全部完成后退出
+int RunWorker(const WaterMarkParam & p, const std::filesystem::path & dir, int lease_seconds,
+              const std::string & worker_id, bool quiet)
+{
+    const QByteArray param_hash = PhotoWaterMarkWork::HashParam(p);
+    ChunkQueue queue;
+    while (!queue.Open(dir, param_hash, worker_id, lease_seconds))
+    {
+        if (ChunkQueue::JobExists(dir))
+            return kExitInitFailed;
+        if (interrupted)
+            return kExitCancelled;
+        // 协调者还在扫描输入
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+
+    const auto renew_interval = std::chrono::milliseconds(std::max(lease_seconds, 1) * 1000 / 3);
+    // 没有可以领取的分块时逐渐延长等待, 减少共享目录上的访问
+    const auto max_idle_wait = std::chrono::seconds(std::max(lease_seconds / 2, 1));
+    auto idle_wait = std::chrono::seconds(1);
+    int failed_total = 0;
+    PhotoWaterMarkWork work;
+    ChunkQueue::Chunk chunk;
+    while (!interrupted)
+    {
+        if (!queue.Claim(chunk))
+        {
+            if (queue.DoneCount() >= queue.ChunkCount())
+                break;
+            // 其他节点持有的分块在租约过期后可以收回
+            for (auto waited = std::chrono::seconds(0); waited < idle_wait && !interrupted; ++waited)
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            idle_wait = std::min(idle_wait * 2, max_idle_wait);
+            continue;
+        }
+        idle_wait = std::chrono::seconds(1);
+
+        WaterMarkParam chunk_param = p;
+        chunk_param.input_files = chunk.files;
+        int images = 0;
+        int failed = 0;
+        progress_callback cb = [&images, &failed](int cur, int failed_count, int, bool, const PipelineMetrics &)
+        {
+            images = cur;
+            failed = failed_count;
+        };
+        work.Clean();
+        if (!work.Init(chunk_param, cb) || !work.WorkStart())
+        {
+            queue.Release(chunk.index);
+            return kExitInitFailed;
+        }
+
+        bool lost = false;
+        auto next_renew = std::chrono::steady_clock::now() + renew_interval;
+        WaitWork(work, [&]
+        {
+            if (std::chrono::steady_clock::now() < next_renew)
+                return true;
+            next_renew += renew_interval;
+            lost = !queue.Renew(chunk.index);
+            return !lost;
+        });
+        if (work.IsCancelled())
+        {
+            if (!lost)
+                queue.Release(chunk.index);
+            continue;
+        }
+        queue.Complete(chunk.index, images, failed);
+        failed_total += failed;
+        if (!quiet)
+            fprintf(stderr, "Chunk %d: %d images, %d failed.\n", chunk.index, images, failed);
+    }
+
+    if (interrupted)
+    {
+        fprintf(stderr, "Cancelled, unfinished chunks can be claimed by other workers.\n");
+        return kExitCancelled;
+    }
+    return failed_total > 0 ? kExitImagesFailed : kExitSuccess;
+}
+}
+
+int main(int argc, char * argv[])
+{
+    // 没有显示设备时也能使用字体与 QPainter
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication a(argc, argv);
+    QGuiApplication::setApplicationName(QStringLiteral("photo_watermark_cli"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral(
+        "Batch add watermarks to photos without a GUI.\n"
+        "Exit codes: 0 success, 1 bad arguments, 2 init failed, 3 some images failed, 4 cancelled.\n"
+        "Text types: none, model, lens, exposure, date, gps, custom, rich.\n"
+        "Config file: ini file using the long option names as keys, e.g. lt=model, no-frame=true."));
+    parser.addHelpOption();
+    parser.addOptions({
+        { { QStringLiteral("c"), QStringLiteral("config") }, QStringLiteral("Read options from an ini file."), QStringLiteral("file") },
+        { { QStringLiteral("i"), QStringLiteral("input") }, QStringLiteral("Input directory."), QStringLiteral("dir") },
+        { { QStringLiteral("o"), QStringLiteral("output") }, QStringLiteral("Output directory."), QStringLiteral("dir") },
+        { QStringLiteral("font"), QStringLiteral("Font family."), QStringLiteral("family") },
+        { QStringLiteral("border-ratio"), QStringLiteral("Border size relative to the long edge."), QStringLiteral("ratio") },
+        { QStringLiteral("logo"), QStringLiteral("Logo name, or Auto to match exif Make."), QStringLiteral("name") },
+        { QStringLiteral("no-frame"), QStringLiteral("Do not add the white frame on the left, top and right.") },
+        { QStringLiteral("auto-align"), QStringLiteral("Center a column when its other row is empty.") },
+        { QStringLiteral("threads"), QStringLiteral("Worker threads per stage, 0 = all cores."), QStringLiteral("count") },
+        { QStringLiteral("queue"), QStringLiteral("Images buffered between pipeline stages."), QStringLiteral("count") },
+        { QStringLiteral("memory-budget"), QStringLiteral("Estimated memory for images in flight, 0 = unlimited. "
+                                                          "A larger image runs alone."), QStringLiteral("MiB") },
+        { QStringLiteral("no-mmap"), QStringLiteral("Read input files instead of mapping them.") },
+        { QStringLiteral("dry-run"), QStringLiteral("Only read exif and resolve logos.") },
+        { QStringLiteral("lossless"), QStringLiteral("Keep source JPEG blocks, only encode the border. The "
+                                                     "border uses the source quantization and sampling; encoder "
+                                                     "settings only apply to images that need rotation or scaling.") },
+        { QStringLiteral("rendition"), QStringLiteral("Output dir:long_edge[:quality[:format]], repeatable. "
+                                                      "dir . = output directory, long_edge 0 = source size, "
+                                                      "default .:0:100:jpg."), QStringLiteral("spec") },
+        { QStringLiteral("quality"), QStringLiteral("Encoder quality 0-100, default 100."), QStringLiteral("quality") },
+        { QStringLiteral("subsampling"), QStringLiteral("Jpeg chroma subsampling: default, 444, 422, 420."), QStringLiteral("mode") },
+        { QStringLiteral("progressive"), QStringLiteral("Write progressive jpeg.") },
+        { QStringLiteral("optimize-huffman"), QStringLiteral("Optimize jpeg Huffman tables.") },
+        { QStringLiteral("fast-encode"), QStringLiteral("Encode jpeg with libjpeg directly from the canvas scanlines.") },
+        { QStringLiteral("no-recursive"), QStringLiteral("Only process images directly in the input directory.") },
+        { QStringLiteral("no-incremental"), QStringLiteral("Process all images, ignore the manifest in the output directory.") },
+        { QStringLiteral("resume"), QStringLiteral("Skip images finished by a cancelled or interrupted run "
+                                                   "with the same settings (Ctrl+C cancels and keeps the checkpoint).") },
+        { QStringLiteral("metrics"), QStringLiteral("Write stage latency histograms, throughput and failure reasons "
+                                                    "to this file at the end, .csv for CSV, otherwise JSON."), QStringLiteral("file") },
+        { QStringLiteral("coordinator"), QStringLiteral("Split the input into chunks in this shared directory "
+                                                        "and wait until workers finish them."), QStringLiteral("dir") },
+        { QStringLiteral("worker"), QStringLiteral("Claim and process chunks from this shared directory "
+                                                   "until all are done."), QStringLiteral("dir") },
+        { QStringLiteral("chunk-size"), QStringLiteral("Images per chunk for --coordinator, default 64."), QStringLiteral("count") },
+        { QStringLiteral("lease-seconds"), QStringLiteral("Seconds before a chunk of a silent worker can be "
+                                                          "reclaimed, default 60."), QStringLiteral("seconds") },
+        { QStringLiteral("worker-id"), QStringLiteral("Worker name in leases, default host-pid."), QStringLiteral("id") },
+        { QStringLiteral("quiet"), QStringLiteral("Do not print progress.") },
+    });
+    for (const auto & slot : slot_options)
+    {
+        parser.addOption({ slot.name, QStringLiteral("Text type at %1.").arg(slot.name), QStringLiteral("type") });
+        parser.addOption({ slot.name + QStringLiteral("-weight"),
+                           QStringLiteral("Font weight at %1, name or number.").arg(slot.name), QStringLiteral("weight") });
+        parser.addOption({ slot.name + QStringLiteral("-text"),
+                           QStringLiteral("Text for custom/rich type at %1.").arg(slot.name), QStringLiteral("text") });
+    }
+    if (!parser.parse(QGuiApplication::arguments()))
+    {
+        fprintf(stderr, "%s\n", qPrintable(parser.errorText()));
+        return kExitBadArguments;
+    }
+    if (parser.isSet(QStringLiteral("help")))
+    {
+        printf("%s", qPrintable(parser.helpText()));
+        return kExitSuccess;
+    }
+
+    std::unique_ptr<QSettings> settings;
+    if (parser.isSet(QStringLiteral("config")))
+    {
+        const QString config = parser.value(QStringLiteral("config"));
+        settings = std::make_unique<QSettings>(config, QSettings::IniFormat);
+        if (!QFileInfo::exists(config) || settings->status() != QSettings::NoError)
+        {
+            fprintf(stderr, "Read config %s failed.\n", qPrintable(parser.value(QStringLiteral("config"))));
+            return kExitBadArguments;
+        }
+    }
+
+    const Options options(parser, settings.get());
+    WaterMarkParam p = { };
+    if (!BuildParam(options, p))
+        return kExitBadArguments;
+    if (p.input_path.empty() || p.output_path.empty())
+    {
+        fprintf(stderr, "Both --input and --output are required.\n");
+        return kExitBadArguments;
+    }
+
+    PhotoWaterMarkWork::LoadBundledFonts();
+
+    const bool quiet = options.Flag(QStringLiteral("quiet"), false);
+    std::signal(SIGINT, OnInterrupt);
+
+    // 分布式处理: 所有节点使用相同的参数, 输入输出路径可以是各自的挂载点
+    const QString coordinator_dir = options.Value(QStringLiteral("coordinator"));
+    const QString worker_dir = options.Value(QStringLiteral("worker"));
+    if (!coordinator_dir.isEmpty() && !worker_dir.isEmpty())
+    {
+        fprintf(stderr, "--coordinator and --worker can't be used together.\n");
+        return kExitBadArguments;
+    }
+    if (!coordinator_dir.isEmpty())
+    {
+        int chunk_size = 64;
+        if (!ParseNumber(options, QStringLiteral("chunk-size"), chunk_size) || chunk_size <= 0)
+            return kExitBadArguments;
+        return RunCoordinator(p, coordinator_dir.toStdString(), chunk_size, quiet);
+    }
+    if (!worker_dir.isEmpty())
+    {
+        int lease_seconds = 60;
+        if (!ParseNumber(options, QStringLiteral("lease-seconds"), lease_seconds) || lease_seconds <= 0)
+            return kExitBadArguments;
+        const QString worker_id = options.Value(QStringLiteral("worker-id"), QSysInfo::machineHostName() + QChar('-') +
+                                                QString::number(QCoreApplication::applicationPid()));
+        return RunWorker(p, worker_dir.toStdString(), lease_seconds, worker_id.toStdString(), quiet);
+    }
+    int failed_count = 0;
+    progress_callback cb = [quiet, &failed_count](int cur, int failed, int total, bool done, const PipelineMetrics & metrics)
+    {
+        failed_count = failed;
+        if (quiet)
+            return;
+        if (!done)
+            fprintf(stderr, "\rProcessing: %d/%d failed: %d %.2f images/s", cur, total, failed, metrics.ImagesPerSecond());
+        else
+            fprintf(stderr, "\nDone: %d images, %d failed.\n", total, failed);
+    };
+
+    PhotoWaterMarkWork work;
+    if (!work.Init(p, cb) || !work.WorkStart())
+        return kExitInitFailed;
+
+    WaitWork(work);
+
+    if (work.IsCancelled())
+    {
+        fprintf(stderr, "Cancelled, run again with --resume to skip finished images.\n");
+        return kExitCancelled;
+    }
+    return failed_count > 0 ? kExitImagesFailed : kExitSuccess;
+}
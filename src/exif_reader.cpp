@@ -0,0 +1,129 @@
+﻿#include "exif_reader.h"
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+namespace
+{
+constexpr unsigned char kMarkerPrefix = 0xFF;
+constexpr unsigned char kSOI = 0xD8;
+constexpr unsigned char kEOI = 0xD9;
+constexpr unsigned char kSOS = 0xDA;
+constexpr unsigned char kAPP1 = 0xE1;
+constexpr unsigned char kTEM = 0x01;
+constexpr unsigned kMinExifSegment = 14; // "Exif\0\0" + TIFF header + IFD offset
+constexpr unsigned char kExifHeader[] = { 'E', 'x', 'i', 'f', 0, 0 };
+
+// 没有长度字段的独立标记
+bool IsStandaloneMarker(unsigned char marker)
+{
+    return marker == kTEM || (marker >= 0xD0 && marker <= 0xD7);
+}
+
+bool IsExifSegment(const unsigned char * body, unsigned body_size)
+{
+    return body_size >= kMinExifSegment && std::equal(std::begin(kExifHeader), std::end(kExifHeader), body);
+}
+}
+
+bool FindExifSegment(const unsigned char * data, size_t size,
+                     const unsigned char ** segment, unsigned * segment_size)
+{
+    if (nullptr == data || size < 4 || data[0] != kMarkerPrefix || data[1] != kSOI)
+        return false;
+
+    size_t offs = 2;
+    while (offs + 2 <= size)
+    {
+        if (data[offs] != kMarkerPrefix)
+            return false;
+        // 标记前可以有任意个 0xFF 填充字节
+        while (offs + 1 < size && data[offs + 1] == kMarkerPrefix)
+            ++offs;
+        if (offs + 2 > size)
+            return false;
+        const unsigned char marker = data[offs + 1];
+        offs += 2;
+        if (marker == kSOS || marker == kEOI)
+            return false;
+        if (IsStandaloneMarker(marker))
+            continue;
+        if (offs + 2 > size)
+            return false;
+
+        // 长度为大端序, 包含长度字段本身
+        const unsigned length = (static_cast<unsigned>(data[offs]) << 8) | data[offs + 1];
+        if (length < 2 || offs + length > size)
+            return false;
+        if (marker == kAPP1 && IsExifSegment(data + offs + 2, length - 2))
+        {
+            *segment = data + offs + 2;
+            *segment_size = length - 2;
+            return true;
+        }
+        offs += length;
+    }
+    return false;
+}
+
+int ParseExif(const unsigned char * data, size_t size, easyexif::EXIFInfo & exif)
+{
+    exif.clear();
+    if (nullptr == data || size < 4 || data[0] != kMarkerPrefix || data[1] != kSOI)
+        return PARSE_EXIF_ERROR_NO_JPEG;
+
+    const unsigned char * segment = nullptr;
+    unsigned segment_size = 0;
+    if (!FindExifSegment(data, size, &segment, &segment_size))
+        return PARSE_EXIF_ERROR_NO_EXIF;
+    return exif.parseFromEXIFSegment(segment, segment_size);
+}
+
+int ReadExif(const std::string & path, easyexif::EXIFInfo & exif)
+{
+    exif.clear();
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (!ifs.good())
+        return PARSE_EXIF_ERROR_NO_JPEG;
+
+    unsigned char header[4] = { 0 };
+    if (!ifs.read(reinterpret_cast<char *>(header), 2) || header[0] != kMarkerPrefix || header[1] != kSOI)
+        return PARSE_EXIF_ERROR_NO_JPEG;
+
+    // 只读取每个段的标记和长度, 其余内容直接 seek 跳过
+    while (ifs.read(reinterpret_cast<char *>(header), 2))
+    {
+        if (header[0] != kMarkerPrefix)
+            return PARSE_EXIF_ERROR_CORRUPT;
+        while (header[1] == kMarkerPrefix)
+        {
+            if (!ifs.read(reinterpret_cast<char *>(header + 1), 1))
+                return PARSE_EXIF_ERROR_CORRUPT;
+        }
+        const unsigned char marker = header[1];
+        if (marker == kSOS || marker == kEOI)
+            return PARSE_EXIF_ERROR_NO_EXIF;
+        if (IsStandaloneMarker(marker))
+            continue;
+        if (!ifs.read(reinterpret_cast<char *>(header + 2), 2))
+            return PARSE_EXIF_ERROR_CORRUPT;
+
+        const unsigned length = (static_cast<unsigned>(header[2]) << 8) | header[3];
+        if (length < 2)
+            return PARSE_EXIF_ERROR_CORRUPT;
+        if (marker != kAPP1)
+        {
+            ifs.seekg(length - 2, std::ios::cur);
+            continue;
+        }
+
+        std::vector<unsigned char> body(length - 2);
+        if (!ifs.read(reinterpret_cast<char *>(body.data()), static_cast<std::streamsize>(body.size())))
+            return PARSE_EXIF_ERROR_CORRUPT;
+        // APP1 也可能是 XMP, 不是 Exif 时继续查找
+        if (IsExifSegment(body.data(), static_cast<unsigned>(body.size())))
+            return exif.parseFromEXIFSegment(body.data(), static_cast<unsigned>(body.size()));
+    }
+    return PARSE_EXIF_ERROR_NO_EXIF;
+}
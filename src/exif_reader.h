@@ -0,0 +1,16 @@
+﻿#pragma once
+#include <cstddef>
+#include <string>
+
+#include "exif.h"
+
+// 遍历 JPEG 标记, 找到 APP1 Exif 段("Exif\0\0" 开头, 不含标记与长度)
+// 遇到 SOS 或 EOI 即停止, 不会扫描压缩数据
+bool FindExifSegment(const unsigned char * data, size_t size,
+                     const unsigned char ** segment, unsigned * segment_size);
+
+// 从内存中的 JPEG 解析 exif, 返回 easyexif 的 PARSE_EXIF_* 错误码
+int ParseExif(const unsigned char * data, size_t size, easyexif::EXIFInfo & exif);
+
+// 只读取文件头部的标记段直到 APP1 Exif 段, 适合只需要元数据的场景
+int ReadExif(const std::string & path, easyexif::EXIFInfo & exif);
@@ -0,0 +1,156 @@
+﻿#include "jpeg_encoder.h"
+
+#include <QDebug>
+
+#ifdef PW_HAVE_LIBJPEG
+#include <vector>
+#include "jpeg_utils.h"
+
+namespace
+{
+bool IsRgb32(QImage::Format format)
+{
+    return format == QImage::Format_RGB32 || format == QImage::Format_ARGB32 ||
+        format == QImage::Format_ARGB32_Premultiplied;
+}
+
+void SetSubsampling(jpeg_compress_struct & cinfo, ChromaSubsampling subsampling)
+{
+    if (cinfo.num_components != 3)
+        return;
+    // Qt 的 jpeg 插件在 jpeg_set_defaults 之后不修改采样, 默认值明确设为同样的 4:2:0,
+    // 开启快速编码时输出与 QImageWriter 一致, 不依赖所链接的 libjpeg 的默认值
+    if (subsampling == ChromaSubsampling::kDefault)
+        subsampling = ChromaSubsampling::k420;
+    // 只需要设置亮度分量, 色度分量保持 1x1
+    cinfo.comp_info[0].h_samp_factor = subsampling == ChromaSubsampling::k444 ? 1 : 2;
+    cinfo.comp_info[0].v_samp_factor = subsampling == ChromaSubsampling::k420 ? 2 : 1;
+    for (int ci = 1; ci < cinfo.num_components; ++ci)
+    {
+        cinfo.comp_info[ci].h_samp_factor = 1;
+        cinfo.comp_info[ci].v_samp_factor = 1;
+    }
+}
+}
+
+bool JpegEncoderAvailable()
+{
+    return true;
+}
+
+bool EncodeJpeg(const QImage & image, const JpegEncodeOptions & options, QByteArray & output)
+{
+    // setjmp 之后不能再构造需要析构的对象
+    QImage source = image;
+    std::vector<JSAMPLE> row_buffer;
+    jpeg_compress_struct cinfo;
+    JpegErrorManager jerr;
+    JpegMemoryDestination destination;
+    unsigned char * reused = nullptr;
+
+    if (source.isNull())
+        return false;
+    if (source.format() != QImage::Format_RGB888 && !IsRgb32(source.format()))
+        source = source.convertToFormat(QImage::Format_RGB32);
+    const bool direct = source.format() == QImage::Format_RGB888;
+#ifdef JCS_EXTENSIONS
+    const bool extended = !direct;
+#else
+    const bool extended = false;
+    if (!direct)
+        row_buffer.resize(static_cast<size_t>(source.width()) * 3);
+#endif
+
+    // output 已有容量时 libjpeg 直接写入其中, 不够时 libjpeg 另外分配并复制
+    output.resize(output.capacity());
+    if (!output.isEmpty())
+    {
+        reused = reinterpret_cast<unsigned char *>(output.data());
+        destination.buffer = reused;
+        destination.size = static_cast<unsigned long>(output.size());
+    }
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = JpegErrorExit;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_compress(&cinfo);
+        if (destination.buffer == reused)
+            destination.buffer = nullptr;
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    cinfo.image_width = static_cast<JDIMENSION>(source.width());
+    cinfo.image_height = static_cast<JDIMENSION>(source.height());
+#ifdef JCS_EXTENSIONS
+    if (extended)
+    {
+        // QImage 的 RGB32 在内存中为 0xAARRGGBB 的本机字节序
+        cinfo.in_color_space = Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? JCS_EXT_BGRX : JCS_EXT_XRGB;
+        cinfo.input_components = 4;
+    }
+    else
+#endif
+    {
+        cinfo.in_color_space = JCS_RGB;
+        cinfo.input_components = 3;
+    }
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, options.quality, TRUE);
+    SetSubsampling(cinfo, options.subsampling);
+    cinfo.optimize_coding = options.optimize_huffman ? TRUE : FALSE;
+    if (options.progressive)
+        jpeg_simple_progression(&cinfo);
+    cinfo.density_unit = 1; // dpi, 与 QImageWriter 一致
+    cinfo.X_density = static_cast<UINT16>(qRound(source.dotsPerMeterX() * 0.0254));
+    cinfo.Y_density = static_cast<UINT16>(qRound(source.dotsPerMeterY() * 0.0254));
+
+    jpeg_mem_dest(&cinfo, &destination.buffer, &destination.size);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        const uchar * line = source.constScanLine(static_cast<int>(cinfo.next_scanline));
+        JSAMPROW row = const_cast<JSAMPROW>(line);
+        if (!direct && !extended)
+        {
+            const auto * pixels = reinterpret_cast<const QRgb *>(line);
+            for (int x = 0; x < source.width(); ++x)
+            {
+                row_buffer[x * 3] = static_cast<JSAMPLE>(qRed(pixels[x]));
+                row_buffer[x * 3 + 1] = static_cast<JSAMPLE>(qGreen(pixels[x]));
+                row_buffer[x * 3 + 2] = static_cast<JSAMPLE>(qBlue(pixels[x]));
+            }
+            row = row_buffer.data();
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    if (destination.buffer == reused)
+    {
+        output.resize(static_cast<qsizetype>(destination.size));
+        destination.buffer = nullptr;
+    }
+    else
+    {
+        output = QByteArray(reinterpret_cast<const char *>(destination.buffer), static_cast<qsizetype>(destination.size));
+    }
+    return true;
+}
+
+#else
+
+bool JpegEncoderAvailable()
+{
+    return false;
+}
+
+bool EncodeJpeg(const QImage &, const JpegEncodeOptions &, QByteArray &)
+{
+    qWarning() << "Jpeg encode: built without libjpeg.";
+    return false;
+}
+
+#endif
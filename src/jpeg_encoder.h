@@ -0,0 +1,26 @@
+﻿#pragma once
+#include <QByteArray>
+#include <QImage>
+
+using ChromaSubsampling = enum class ChromaSubsampling
+{
+    kDefault, // 与 QImageWriter 相同, 为 4:2:0
+    k444,
+    k422,
+    k420,
+};
+
+using JpegEncodeOptions = struct JpegEncodeOptions
+{
+    int quality = 100;
+    ChromaSubsampling subsampling = ChromaSubsampling::kDefault;
+    bool progressive = false;
+    bool optimize_huffman = false;
+};
+
+// 是否编译了 libjpeg 支持
+bool JpegEncoderAvailable();
+
+// 直接把 image 的扫描线交给 libjpeg 编码, 不经过 QImageWriter
+// libjpeg-turbo 可以直接读取 RGB32/ARGB32, 其他情况逐行转换为 RGB, 图片需要是不透明的
+bool EncodeJpeg(const QImage & image, const JpegEncodeOptions & options, QByteArray & output);
@@ -0,0 +1,33 @@
+﻿#pragma once
+// libjpeg 的公共辅助类型, 只在定义了 PW_HAVE_LIBJPEG 的源文件中使用
+#ifdef PW_HAVE_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <jpeglib.h>
+#include <QDebug>
+
+using JpegErrorManager = struct JpegErrorManager
+{
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+// libjpeg 出错时跳回调用处, 由调用者负责销毁对象
+inline void JpegErrorExit(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX] = { 0 };
+    (*cinfo->err->format_message)(cinfo, message);
+    qWarning() << "libjpeg:" << message;
+    longjmp(reinterpret_cast<JpegErrorManager *>(cinfo->err)->jump, 1);
+}
+
+// jpeg_mem_dest 分配的输出缓冲
+using JpegMemoryDestination = struct JpegMemoryDestination
+{
+    unsigned char * buffer = nullptr;
+    unsigned long size = 0;
+
+    ~JpegMemoryDestination() { free(buffer); }
+};
+#endif
@@ -0,0 +1,76 @@
+﻿#include "logo_index.h"
+
+#include <algorithm>
+#include <cctype>
+
+void LogoIndex::Build(const std::vector<std::string> & names)
+{
+    Clear();
+    for (const auto & name : names)
+    {
+        std::string folded = Fold(name);
+        if (folded.empty())
+            continue;
+        max_length_ = std::max(max_length_, folded.size());
+        // 只有大小写不同的文件名保留字典序较小的一个
+        auto [it, inserted] = names_.emplace(folded, name);
+        if (!inserted && name < it->second)
+            it->second = name;
+    }
+    sorted_.reserve(names_.size());
+    for (const auto & [folded, name] : names_)
+        sorted_.push_back(folded);
+    std::ranges::sort(sorted_);
+}
+
+void LogoIndex::Clear()
+{
+    names_.clear();
+    sorted_.clear();
+    max_length_ = 0;
+    std::lock_guard lock(mutex_);
+    resolved_.clear();
+}
+
+std::string LogoIndex::Resolve(const std::string & make) const
+{
+    {
+        std::lock_guard lock(mutex_);
+        auto found = resolved_.find(make);
+        if (found != resolved_.end())
+            return found->second;
+    }
+
+    std::string name = Lookup(Fold(make));
+    std::lock_guard lock(mutex_);
+    resolved_.emplace(make, name);
+    return name;
+}
+
+std::string LogoIndex::Fold(const std::string & text)
+{
+    std::string folded(text);
+    std::ranges::transform(folded, folded.begin(),
+                           [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return folded;
+}
+
+std::string LogoIndex::Lookup(const std::string & folded) const
+{
+    if (folded.empty())
+        return { };
+
+    // 完全相同或 logo 名为 Make 的前缀, 从长到短查哈希表
+    for (size_t length = std::min(folded.size(), max_length_); length > 0; --length)
+    {
+        auto found = names_.find(folded.substr(0, length));
+        if (found != names_.end())
+            return found->second;
+    }
+
+    // Make 为 logo 名的前缀
+    auto candidate = std::ranges::lower_bound(sorted_, folded);
+    if (candidate != sorted_.end() && candidate->starts_with(folded))
+        return names_.at(*candidate);
+    return { };
+}
@@ -0,0 +1,34 @@
+﻿#pragma once
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// logo 名称索引, 忽略大小写匹配 exif.Make 与 logo 文件名
+// 匹配优先级:
+//   1. 完全相同
+//   2. logo 名是 Make 的前缀时取最长的, 如 "NIKON CORPORATION" -> nikon
+//   3. Make 是 logo 名的前缀时取字典序最小的
+class LogoIndex
+{
+public:
+    void Build(const std::vector<std::string> & names);
+
+    void Clear();
+
+    // 返回匹配到的 logo 名称, 没有匹配时返回空字符串, 结果按 Make 缓存
+    std::string Resolve(const std::string & make) const;
+
+private:
+    static std::string Fold(const std::string & text);
+
+    std::string Lookup(const std::string & folded) const;
+
+    std::unordered_map<std::string, std::string> names_; // <folded name, name>
+    std::vector<std::string> sorted_; // 排序后的 folded name
+    size_t max_length_ = 0;
+
+    mutable std::mutex mutex_;
+    mutable std::unordered_map<std::string, std::string> resolved_; // <make, name>
+};
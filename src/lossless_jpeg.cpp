@@ -0,0 +1,292 @@
+﻿#include "lossless_jpeg.h"
+
+#include <QDebug>
+
+#ifdef PW_HAVE_LIBJPEG
+#include <cstring>
+#include "jpeg_utils.h"
+
+namespace
+{
+// 单个颜色分量的 DCT 系数, 每个块 DCTSIZE2 个
+using ComponentBlocks = struct ComponentBlocks
+{
+    JDIMENSION width = 0;
+    JDIMENSION height = 0;
+    std::vector<JCOEF> coefs;
+};
+
+void SetSource(j_decompress_ptr cinfo, const QByteArray & data)
+{
+    jpeg_mem_src(cinfo, reinterpret_cast<unsigned char *>(const_cast<char *>(data.constData())),
+                 static_cast<unsigned long>(data.size()));
+}
+
+bool IsSupported(const jpeg_decompress_struct & cinfo)
+{
+    return (cinfo.jpeg_color_space == JCS_YCbCr && cinfo.num_components == 3) ||
+        (cinfo.jpeg_color_space == JCS_GRAYSCALE && cinfo.num_components == 1);
+}
+
+// 用与原图相同的采样因子和量化表编码 image, 得到的系数可以直接放进原图的系数矩阵
+bool EncodeWithSourceTables(j_decompress_ptr source, const QImage & image, QByteArray & output)
+{
+    const QImage rgb = image.convertToFormat(QImage::Format_RGB888);
+    jpeg_compress_struct cinfo;
+    JpegErrorManager jerr;
+    JpegMemoryDestination destination;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = JpegErrorExit;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_compress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_copy_critical_parameters(source, &cinfo);
+    cinfo.image_width = static_cast<JDIMENSION>(rgb.width());
+    cinfo.image_height = static_cast<JDIMENSION>(rgb.height());
+    cinfo.in_color_space = JCS_RGB;
+    cinfo.input_components = 3;
+    jpeg_mem_dest(&cinfo, &destination.buffer, &destination.size);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = const_cast<JSAMPROW>(rgb.constScanLine(static_cast<int>(cinfo.next_scanline)));
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    output = QByteArray(reinterpret_cast<const char *>(destination.buffer), static_cast<qsizetype>(destination.size));
+    return true;
+}
+
+bool DecodeCoefficients(const QByteArray & data, std::vector<ComponentBlocks> & components)
+{
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = JpegErrorExit;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    SetSource(&cinfo, data);
+    jpeg_read_header(&cinfo, TRUE);
+    jvirt_barray_ptr * coef_arrays = jpeg_read_coefficients(&cinfo);
+    components.resize(static_cast<size_t>(cinfo.num_components));
+    for (int ci = 0; ci < cinfo.num_components; ++ci)
+    {
+        const jpeg_component_info * comp = cinfo.comp_info + ci;
+        auto & blocks = components[ci];
+        blocks.width = comp->width_in_blocks;
+        blocks.height = comp->height_in_blocks;
+        blocks.coefs.resize(static_cast<size_t>(blocks.width) * blocks.height * DCTSIZE2);
+        for (JDIMENSION row = 0; row < blocks.height; ++row)
+        {
+            JBLOCKARRAY from = (*cinfo.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&cinfo),
+                                                                 coef_arrays[ci], row, 1, FALSE);
+            memcpy(blocks.coefs.data() + static_cast<size_t>(row) * blocks.width * DCTSIZE2,
+                   from[0], blocks.width * sizeof(JBLOCK));
+        }
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+bool IsAligned(int value, int unit)
+{
+    return value >= 0 && value % unit == 0;
+}
+}
+
+bool LosslessJpegAvailable()
+{
+    return true;
+}
+
+bool ReadLosslessGeometry(const QByteArray & source, int & width, int & height,
+                          int & mcu_width, int & mcu_height)
+{
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = JpegErrorExit;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    SetSource(&cinfo, source);
+    jpeg_read_header(&cinfo, TRUE);
+    const bool supported = IsSupported(cinfo);
+    width = static_cast<int>(cinfo.image_width);
+    height = static_cast<int>(cinfo.image_height);
+    mcu_width = cinfo.max_h_samp_factor * DCTSIZE;
+    mcu_height = cinfo.max_v_samp_factor * DCTSIZE;
+    jpeg_destroy_decompress(&cinfo);
+
+    return supported && IsAligned(width, mcu_width) && IsAligned(height, mcu_height);
+}
+
+bool ComposeLosslessJpeg(const QByteArray & source, const LosslessLayout & layout, QByteArray & output)
+{
+    jpeg_decompress_struct src;
+    jpeg_compress_struct dst;
+    JpegErrorManager jerr;
+    JpegMemoryDestination destination;
+    std::vector<ComponentBlocks> white;
+    std::vector<std::vector<ComponentBlocks>> strips(layout.strips.size());
+    std::vector<jvirt_barray_ptr> dst_arrays;
+    QImage white_mcu;
+    QByteArray encoded;
+
+    src.err = jpeg_std_error(&jerr.pub);
+    dst.err = &jerr.pub;
+    jerr.pub.error_exit = JpegErrorExit;
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        return false;
+    }
+
+    SetSource(&src, source);
+    jpeg_read_header(&src, TRUE);
+    const int mcu_w = src.max_h_samp_factor * DCTSIZE;
+    const int mcu_h = src.max_v_samp_factor * DCTSIZE;
+    bool valid = IsSupported(src) &&
+        IsAligned(static_cast<int>(src.image_width), mcu_w) && IsAligned(static_cast<int>(src.image_height), mcu_h) &&
+        IsAligned(layout.output_width, mcu_w) && IsAligned(layout.output_height, mcu_h) &&
+        IsAligned(layout.source_x, mcu_w) && IsAligned(layout.source_y, mcu_h) &&
+        layout.source_x + static_cast<int>(src.image_width) <= layout.output_width &&
+        layout.source_y + static_cast<int>(src.image_height) <= layout.output_height;
+    for (const auto & strip : layout.strips)
+    {
+        valid = valid && IsAligned(strip.x, mcu_w) && IsAligned(strip.y, mcu_h) &&
+            IsAligned(strip.image.width(), mcu_w) && IsAligned(strip.image.height(), mcu_h) &&
+            strip.x + strip.image.width() <= layout.output_width &&
+            strip.y + strip.image.height() <= layout.output_height;
+    }
+    if (!valid)
+    {
+        qWarning() << "Lossless compose: layout is not MCU aligned.";
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        return false;
+    }
+
+    // 边框区域只编码一次白色 MCU, 其余位置复制它的系数
+    white_mcu = QImage(mcu_w, mcu_h, QImage::Format_RGB888);
+    white_mcu.fill(Qt::white);
+    bool ok = EncodeWithSourceTables(&src, white_mcu, encoded) && DecodeCoefficients(encoded, white);
+    for (size_t i = 0; ok && i < layout.strips.size(); ++i)
+        ok = EncodeWithSourceTables(&src, layout.strips[i].image, encoded) && DecodeCoefficients(encoded, strips[i]);
+    if (!ok)
+    {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        return false;
+    }
+
+    // 输出的系数矩阵在 jpeg_read_coefficients 时一并分配
+    const int num_components = src.num_components;
+    const JDIMENSION mcu_cols = static_cast<JDIMENSION>(layout.output_width / mcu_w);
+    const JDIMENSION mcu_rows = static_cast<JDIMENSION>(layout.output_height / mcu_h);
+    dst_arrays.resize(static_cast<size_t>(num_components));
+    for (int ci = 0; ci < num_components; ++ci)
+    {
+        const jpeg_component_info * comp = src.comp_info + ci;
+        dst_arrays[ci] = (*src.mem->request_virt_barray)(reinterpret_cast<j_common_ptr>(&src), JPOOL_IMAGE, FALSE,
+                                                        mcu_cols * comp->h_samp_factor,
+                                                        mcu_rows * comp->v_samp_factor,
+                                                        comp->v_samp_factor);
+    }
+    jvirt_barray_ptr * src_arrays = jpeg_read_coefficients(&src);
+
+    auto access = [&src](jvirt_barray_ptr array, JDIMENSION row, boolean writable) -> JBLOCKROW
+    {
+        return (*src.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&src), array, row, 1, writable)[0];
+    };
+
+    for (int ci = 0; ci < num_components; ++ci)
+    {
+        const jpeg_component_info * comp = src.comp_info + ci;
+        const JDIMENSION out_cols = mcu_cols * comp->h_samp_factor;
+        const JDIMENSION out_rows = mcu_rows * comp->v_samp_factor;
+        const JDIMENSION src_x = static_cast<JDIMENSION>(layout.source_x / mcu_w) * comp->h_samp_factor;
+        const JDIMENSION src_y = static_cast<JDIMENSION>(layout.source_y / mcu_h) * comp->v_samp_factor;
+        const JCOEF * white_block = white[ci].coefs.data();
+
+        for (JDIMENSION row = 0; row < out_rows; ++row)
+        {
+            JBLOCKROW out_row = access(dst_arrays[ci], row, TRUE);
+            const bool in_source = row >= src_y && row < src_y + comp->height_in_blocks;
+            for (JDIMENSION col = 0; col < out_cols; ++col)
+            {
+                if (in_source && col >= src_x && col < src_x + comp->width_in_blocks)
+                    continue;
+                memcpy(out_row[col], white_block, sizeof(JBLOCK));
+            }
+            if (in_source)
+                memcpy(out_row + src_x, access(src_arrays[ci], row - src_y, FALSE),
+                       comp->width_in_blocks * sizeof(JBLOCK));
+        }
+
+        for (size_t i = 0; i < layout.strips.size(); ++i)
+        {
+            const auto & blocks = strips[i][ci];
+            const JDIMENSION strip_x = static_cast<JDIMENSION>(layout.strips[i].x / mcu_w) * comp->h_samp_factor;
+            const JDIMENSION strip_y = static_cast<JDIMENSION>(layout.strips[i].y / mcu_h) * comp->v_samp_factor;
+            for (JDIMENSION row = 0; row < blocks.height; ++row)
+            {
+                memcpy(access(dst_arrays[ci], strip_y + row, TRUE) + strip_x,
+                       blocks.coefs.data() + static_cast<size_t>(row) * blocks.width * DCTSIZE2,
+                       blocks.width * sizeof(JBLOCK));
+            }
+        }
+    }
+
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.image_width = static_cast<JDIMENSION>(layout.output_width);
+    dst.image_height = static_cast<JDIMENSION>(layout.output_height);
+    jpeg_mem_dest(&dst, &destination.buffer, &destination.size);
+    jpeg_write_coefficients(&dst, dst_arrays.data());
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+
+    output = QByteArray(reinterpret_cast<const char *>(destination.buffer), static_cast<qsizetype>(destination.size));
+    return true;
+}
+
+#else
+
+bool LosslessJpegAvailable()
+{
+    return false;
+}
+
+bool ReadLosslessGeometry(const QByteArray &, int &, int &, int &, int &)
+{
+    return false;
+}
+
+bool ComposeLosslessJpeg(const QByteArray &, const LosslessLayout &, QByteArray &)
+{
+    qWarning() << "Lossless compose: built without libjpeg.";
+    return false;
+}
+
+#endif
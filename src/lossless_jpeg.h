@@ -0,0 +1,31 @@
+﻿#pragma once
+#include <vector>
+#include <QByteArray>
+#include <QImage>
+
+// 无损拼接时需要重新编码的区域, 位置与尺寸必须按 MCU 对齐
+using LosslessStrip = struct LosslessStrip
+{
+    int x = 0;
+    int y = 0;
+    QImage image;
+};
+
+using LosslessLayout = struct LosslessLayout
+{
+    int output_width = 0;
+    int output_height = 0;
+    int source_x = 0;
+    int source_y = 0;
+    std::vector<LosslessStrip> strips; // 未被原图和 strips 覆盖的区域填充白色
+};
+
+// 是否编译了 libjpeg 支持
+bool LosslessJpegAvailable();
+
+// 读取 JPEG 头, 原图尺寸按 MCU 对齐且色彩空间为 YCbCr/灰度时返回 true
+bool ReadLosslessGeometry(const QByteArray & source, int & width, int & height,
+                          int & mcu_width, int & mcu_height);
+
+// 原图的 DCT 系数原样复制到输出中, 只有边框与水印区域需要编码
+bool ComposeLosslessJpeg(const QByteArray & source, const LosslessLayout & layout, QByteArray & output);
@@ -1,11 +1,13 @@
 ﻿#include "mainWidgets.h"
 #include "utils.h"
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QListView>
 #include <QAbstractItemView>
+#include <QPixmap>
 
 #include "photo_watermark.h"
 
@@ -20,6 +22,9 @@ static QStringList set_combox_items = {
     QStringLiteral("HTML富文本")
 };
 
+// 最后一次修改设置后等待的时间, 之前的修改不会单独渲染
+constexpr int kPreviewDebounceMs = 60;
+
 static QStringList font_weight_items = {
     QStringLiteral("Thin"),
     QStringLiteral("ExtraLight"),
@@ -33,13 +38,19 @@ static QStringList font_weight_items = {
 };
 
 mainWidgets::mainWidgets(QWidget * parent)
+    : preview_renderer_([this](uint64_t generation, const QImage & preview) { previewReady(generation, preview); })
 {
     ui_.setupUi(this);
-    this->resize(919, 596);
+    this->resize(1400, 596);
     connect(ui_.inputButton, &QPushButton::clicked, this, &mainWidgets::OnInputBtnClick);
     connect(ui_.outputButton, &QPushButton::clicked, this, &mainWidgets::OnOutputBtnClick);
     connect(ui_.startButton, &QPushButton::clicked, this, &mainWidgets::OnStartBtnClick);
+    connect(ui_.pauseButton, &QPushButton::clicked, this, &mainWidgets::OnPauseBtnClick);
+    connect(ui_.cancelButton, &QPushButton::clicked, this, &mainWidgets::OnCancelBtnClick);
     connect(this, &mainWidgets::processComplete, this, &mainWidgets::OnProcessComplete);
+    connect(ui_.previewButton, &QPushButton::clicked, this, &mainWidgets::OnPreviewBtnClick);
+    // 预览在后台线程渲染完成后回到界面线程显示
+    connect(this, &mainWidgets::previewReady, this, &mainWidgets::OnPreviewReady, Qt::QueuedConnection);
 
     // 初始配置初始化
     ui_.boxSizeComboBox->setValue(0.02);
@@ -56,16 +67,7 @@ mainWidgets::mainWidgets(QWidget * parent)
             ui_.logoComboBox->addItem(QString::fromStdString(logo_file.path().stem().string()));
     }
 
-    auto font_path(self_path / "font");
-    if (std::filesystem::exists(font_path))
-    {
-        for (auto & file : std::filesystem::directory_iterator(font_path))
-        {
-            auto id = QFontDatabase::addApplicationFont(std::filesystem::absolute(file).string().c_str());
-            if (id >= 0)
-                QFontDatabase::applicationFontFamilies(id);
-        }
-    }
+    PhotoWaterMarkWork::LoadBundledFonts();
     QFont f("MiSans Latin");
     ui_.fontComboBox->setCurrentFont(f);
     ui_.fontComboBox->lineEdit()->setAlignment(Qt::AlignCenter);
@@ -105,9 +107,9 @@ mainWidgets::mainWidgets(QWidget * parent)
     connect(ui_.RBChoice, &QComboBox::currentIndexChanged,
             this, [this](int x) { OnComboBoxChanged(x, ui_.RBEdit); });
 
-    cb_ = [this](int cur, int failed, int total, bool done)
+    cb_ = [this](int cur, int failed, int total, bool done, const PipelineMetrics & metrics)
     {
-        MainWidgetsProgressCallback(cur, failed, total, done);
+        MainWidgetsProgressCallback(cur, failed, total, done, metrics);
     };
 
     ui_.lnputEdit->installEventFilter(this);
@@ -126,9 +128,25 @@ mainWidgets::mainWidgets(QWidget * parent)
     ui_.RTEdit->setEnabled(false);
     ui_.LBEdit->setEnabled(false);
     ui_.RBEdit->setEnabled(false);
+
+    // 任意设置改变后刷新预览
+    preview_timer_.setSingleShot(true);
+    preview_timer_.setInterval(kPreviewDebounceMs);
+    connect(&preview_timer_, &QTimer::timeout, this, &mainWidgets::RequestPreview);
+    connect(ui_.fontComboBox, &QFontComboBox::currentFontChanged, this, &mainWidgets::SchedulePreview);
+    connect(ui_.boxSizeComboBox, &QDoubleSpinBox::valueChanged, this, &mainWidgets::SchedulePreview);
+    connect(ui_.logoComboBox, &QComboBox::currentIndexChanged, this, &mainWidgets::SchedulePreview);
+    connect(ui_.addFrameCheckBox, &QCheckBox::toggled, this, &mainWidgets::SchedulePreview);
+    connect(ui_.autoAlignCheckBox, &QCheckBox::toggled, this, &mainWidgets::SchedulePreview);
+    for (QComboBox * combo : { ui_.LTChoice, ui_.RTChoice, ui_.LBChoice, ui_.RBChoice })
+        connect(combo, &QComboBox::currentIndexChanged, this, &mainWidgets::SchedulePreview);
+    for (QComboBox * combo : { ui_.LTWeight, ui_.RTWeight, ui_.LBWeight, ui_.RBWeight })
+        connect(combo, &QComboBox::currentTextChanged, this, &mainWidgets::SchedulePreview);
+    for (QTextEdit * edit : { ui_.LTEdit, ui_.RTEdit, ui_.LBEdit, ui_.RBEdit })
+        connect(edit, &QTextEdit::textChanged, this, &mainWidgets::SchedulePreview);
 }
 
-void mainWidgets::OnStartBtnClick()
+WaterMarkParam mainWidgets::GetParam() const
 {
     WaterMarkParam p = { };
     p.input_path = ui_.lnputEdit->text().toStdString();
@@ -142,26 +160,41 @@ void mainWidgets::OnStartBtnClick()
     auto & lt_setting = p.text_settings[TextPosition::kLeftTop];
     lt_setting.text_type = static_cast<TextType>(ui_.LTChoice->currentIndex());
     lt_setting.weight = GetFontWeight(ui_.LTWeight);
-    if (lt_setting.text_type == TextType::kCustomString)
+    if (lt_setting.text_type == TextType::kCustomString || lt_setting.text_type == TextType::KRichText)
         lt_setting.custom_data = ui_.LTEdit->toPlainText();
 
     auto & rt_setting = p.text_settings[TextPosition::kRightTop];
     rt_setting.text_type = static_cast<TextType>(ui_.RTChoice->currentIndex());
     rt_setting.weight = GetFontWeight(ui_.RTWeight);
-    if (rt_setting.text_type == TextType::kCustomString)
+    if (rt_setting.text_type == TextType::kCustomString || rt_setting.text_type == TextType::KRichText)
         rt_setting.custom_data = ui_.RTEdit->toPlainText();
 
     auto & lb_setting = p.text_settings[TextPosition::kLeftBottom];
     lb_setting.text_type = static_cast<TextType>(ui_.LBChoice->currentIndex());
     lb_setting.weight = GetFontWeight(ui_.LBWeight);
-    if (lb_setting.text_type == TextType::kCustomString)
+    if (lb_setting.text_type == TextType::kCustomString || lb_setting.text_type == TextType::KRichText)
         lb_setting.custom_data = ui_.LBEdit->toPlainText();
 
     auto & rb_setting = p.text_settings[TextPosition::kRightBottom];
     rb_setting.text_type = static_cast<TextType>(ui_.RBChoice->currentIndex());
     rb_setting.weight = GetFontWeight(ui_.RBWeight);
-    if (rb_setting.text_type == TextType::kCustomString)
+    if (rb_setting.text_type == TextType::kCustomString || rb_setting.text_type == TextType::KRichText)
         rb_setting.custom_data = ui_.RBEdit->toPlainText();
+    return p;
+}
+
+void mainWidgets::OnStartBtnClick()
+{
+    WaterMarkParam p = GetParam();
+
+    // 上次处理被取消或中断时可以跳过已经完成的图片
+    const auto checkpoint_path = std::filesystem::path(p.output_path) / Checkpoint::kFileName;
+    if (std::filesystem::exists(checkpoint_path))
+    {
+        p.resume = QMessageBox::question(this, QStringLiteral("继续处理"),
+                                         QStringLiteral("输出文件夹中有上次未完成的处理记录, 是否跳过已经完成的图片?")) ==
+            QMessageBox::Yes;
+    }
 
     work_.Clean();
     if (!work_.Init(p, cb_))
@@ -170,8 +203,35 @@ void mainWidgets::OnStartBtnClick()
         return;
     }
 
-    work_.WorkStart();
+    if (!work_.WorkStart())
+        return;
     ui_.startButton->setEnabled(false);
+    ui_.pauseButton->setEnabled(true);
+    ui_.pauseButton->setText(QStringLiteral("暂停"));
+    ui_.cancelButton->setEnabled(true);
+}
+
+void mainWidgets::OnPauseBtnClick()
+{
+    if (work_.IsPaused())
+    {
+        work_.Resume();
+        ui_.pauseButton->setText(QStringLiteral("暂停"));
+    }
+    else
+    {
+        work_.Pause();
+        ui_.pauseButton->setText(QStringLiteral("继续"));
+        ui_.workStatus->setText(QStringLiteral("已暂停"));
+    }
+}
+
+void mainWidgets::OnCancelBtnClick()
+{
+    work_.Cancel();
+    ui_.pauseButton->setEnabled(false);
+    ui_.cancelButton->setEnabled(false);
+    ui_.workStatus->setText(QStringLiteral("正在取消"));
 }
 
 void mainWidgets::OnInputBtnClick()
@@ -202,19 +262,86 @@ void mainWidgets::OnComboBoxChanged(int index, QTextEdit * edit)
         edit->setEnabled(false);
 }
 
+void mainWidgets::OnPreviewBtnClick()
+{
+    const QString file_name = QFileDialog::getOpenFileName(this, QStringLiteral("选择预览图片"), ui_.lnputEdit->text(),
+                                                           QStringLiteral("JPEG (*.jpg *.jpeg)"), nullptr,
+                                                           QFileDialog::DontUseNativeDialog);
+    if (file_name.isEmpty())
+        return;
+    preview_path_ = file_name;
+    RequestPreview();
+}
+
+void mainWidgets::SchedulePreview()
+{
+    if (!preview_path_.isEmpty())
+        preview_timer_.start();
+}
+
+void mainWidgets::RequestPreview()
+{
+    if (preview_path_.isEmpty())
+        return;
+    // 按预览区域的物理像素解码, 水印尺寸随原图等比缩小
+    const QSize size = ui_.previewLabel->size() * ui_.previewLabel->devicePixelRatioF();
+    preview_renderer_.Request(GetParam(), preview_path_.toStdString(), std::max(size.width(), size.height()));
+}
+
+void mainWidgets::OnPreviewReady(quint64 generation, const QImage & preview)
+{
+    if (generation != preview_renderer_.Generation())
+        return;
+    if (preview.isNull())
+    {
+        ui_.previewLabel->setPixmap(QPixmap());
+        ui_.previewLabel->setText(QStringLiteral("预览失败"));
+        return;
+    }
+    QPixmap pixmap = QPixmap::fromImage(preview.scaled(ui_.previewLabel->size() * ui_.previewLabel->devicePixelRatioF(),
+                                                        Qt::KeepAspectRatio, Qt::SmoothTransformation));
+    pixmap.setDevicePixelRatio(ui_.previewLabel->devicePixelRatioF());
+    ui_.previewLabel->setPixmap(pixmap);
+}
+
+void mainWidgets::resizeEvent(QResizeEvent * event)
+{
+    QWidget::resizeEvent(event);
+    SchedulePreview();
+}
+
 void mainWidgets::OnProcessComplete(int total, int failed)
 {
-    QString ss = QString::asprintf("处理完成\n共计处理%d张图片\n失败%d张", total, failed);
-    QMessageBox::information(this, QStringLiteral("处理结果"), ss);
+    ui_.pauseButton->setEnabled(false);
+    ui_.cancelButton->setEnabled(false);
+    const MetricsSnapshot metrics = work_.GetMetrics();
+    QString ss = work_.IsCancelled()
+        ? QStringLiteral("处理已取消\n再次开始时可以跳过已经完成的图片")
+        : QString::asprintf("处理完成\n共计处理%d张图片\n失败%d张", total, failed);
+    ss += QString::asprintf("\n用时%.1f秒, %.2f张/秒", metrics.elapsed_seconds, metrics.images_per_second);
+
+    // 可以把各阶段耗时与失败原因导出为 json 或 csv
+    QMessageBox box(QMessageBox::Information, QStringLiteral("处理结果"), ss, QMessageBox::Ok, this);
+    const QPushButton * export_button = box.addButton(QStringLiteral("导出统计"), QMessageBox::ActionRole);
+    box.exec();
+    if (box.clickedButton() == export_button)
+    {
+        const QString path = QFileDialog::getSaveFileName(this, QStringLiteral("导出统计"), QStringLiteral("metrics.json"),
+                                                          QStringLiteral("JSON (*.json);;CSV (*.csv)"));
+        if (!path.isEmpty() && !PipelineMetrics::Export(metrics, path.toStdString()))
+            QMessageBox::warning(this, QStringLiteral("导出失败"), path);
+    }
     ui_.workStatus->setText(QStringLiteral("处理未开始"));
     ui_.startButton->setEnabled(true);
 }
 
-void mainWidgets::MainWidgetsProgressCallback(int cur, int failed, int total, bool done)
+void mainWidgets::MainWidgetsProgressCallback(int cur, int failed, int total, bool done,
+                                              const PipelineMetrics & metrics)
 {
     if (!done)
     {
-        QString ss = QString::asprintf("处理中: %d/%d\t失败数: %d", cur, total, failed);
+        QString ss = QString::asprintf("处理中: %d/%d\t失败数: %d\t%.2f张/秒", cur, total, failed,
+                                       metrics.ImagesPerSecond());
         ui_.workStatus->setText(ss);
         return;
     }
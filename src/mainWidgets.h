@@ -1,7 +1,10 @@
 ﻿#pragma once
 #include "ui_mainWidgets.h"
 #include "photo_watermark.h"
+#include "preview_renderer.h"
+#include <QImage>
 #include <QTextEdit>
+#include <QTimer>
 
 class mainWidgets :public QWidget
 {
@@ -11,18 +14,31 @@ public:
 
 public slots:
     void OnStartBtnClick();
+    void OnPauseBtnClick();
+    void OnCancelBtnClick();
     void OnInputBtnClick();
     void OnOutputBtnClick();
     void OnComboBoxChanged(int index, QTextEdit * edit);
+    void OnPreviewBtnClick();
 
     void OnProcessComplete(int total, int failed);
+    void OnPreviewReady(quint64 generation, const QImage & preview);
 
 signals:
     void processComplete(int total, int failed);
+    void previewReady(quint64 generation, const QImage & preview);
 
 protected:
-    void MainWidgetsProgressCallback(int cur, int failed, int total, bool done);
+    void MainWidgetsProgressCallback(int cur, int failed, int total, bool done, const PipelineMetrics & metrics);
     bool eventFilter(QObject * object, QEvent * event) override;
+    void resizeEvent(QResizeEvent * event) override;
+
+    // 界面中的设置, 开始处理与预览共用
+    WaterMarkParam GetParam() const;
+
+    // 设置改变后等待一小段时间再渲染, 连续的修改只渲染最后一次
+    void SchedulePreview();
+    void RequestPreview();
 
     void setComboBoxTextAlignCenterAndBorderRadius(QComboBox * combo);
     static int GetFontWeight(const QComboBox * combo);
@@ -33,4 +49,8 @@ private:
     progress_callback cb_ = nullptr;
 
     PhotoWaterMarkWork work_;
+
+    QString preview_path_;
+    QTimer preview_timer_;
+    PreviewRenderer preview_renderer_;
 };
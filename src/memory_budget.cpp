@@ -0,0 +1,85 @@
+﻿#include "memory_budget.h"
+
+#include <algorithm>
+#include <limits>
+
+void MemoryBudget::Reset(int64_t limit)
+{
+    std::lock_guard lock(mutex_);
+    limit_ = limit;
+    in_use_ = 0;
+    peak_ = 0;
+    waits_ = 0;
+    closed_ = false;
+}
+
+bool MemoryBudget::Acquire(int64_t bytes)
+{
+    std::unique_lock lock(mutex_);
+    if (!closed_ && !Fits(bytes))
+    {
+        ++waits_;
+        released_.wait(lock, [this, bytes] { return closed_ || Fits(bytes); });
+    }
+    if (closed_)
+        return false;
+    in_use_ += bytes;
+    peak_ = std::max(peak_, in_use_);
+    return true;
+}
+
+bool MemoryBudget::TryAcquire(int64_t bytes)
+{
+    std::lock_guard lock(mutex_);
+    if (closed_ || !Fits(bytes))
+        return false;
+    in_use_ += bytes;
+    peak_ = std::max(peak_, in_use_);
+    return true;
+}
+
+void MemoryBudget::Release(int64_t bytes)
+{
+    if (bytes <= 0)
+        return;
+    {
+        std::lock_guard lock(mutex_);
+        in_use_ -= bytes;
+    }
+    released_.notify_all();
+}
+
+void MemoryBudget::Close()
+{
+    {
+        std::lock_guard lock(mutex_);
+        closed_ = true;
+    }
+    released_.notify_all();
+}
+
+int64_t MemoryBudget::Available() const
+{
+    std::lock_guard lock(mutex_);
+    if (limit_ <= 0)
+        return std::numeric_limits<int64_t>::max();
+    return std::max<int64_t>(limit_ - in_use_, 0);
+}
+
+int64_t MemoryBudget::Peak() const
+{
+    std::lock_guard lock(mutex_);
+    return peak_;
+}
+
+int MemoryBudget::Waits() const
+{
+    std::lock_guard lock(mutex_);
+    return waits_;
+}
+
+bool MemoryBudget::Fits(int64_t bytes) const
+{
+    // 没有其他图片时总是允许, 超过上限的图片单独处理
+    return limit_ <= 0 || in_use_ == 0 || in_use_ + bytes <= limit_;
+}
@@ -0,0 +1,43 @@
+﻿#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// 限制流水线中同时处理的图片占用的内存, 按解码前估算的字节数记账
+// 超过上限的单张图片等到其他图片全部完成后单独处理
+class MemoryBudget
+{
+public:
+    // limit <= 0 时不限制, 只统计
+    void Reset(int64_t limit);
+
+    // 阻塞直到可以容纳 bytes, Close 后返回 false
+    bool Acquire(int64_t bytes);
+
+    // 不等待, 放不下时返回 false
+    bool TryAcquire(int64_t bytes);
+
+    void Release(int64_t bytes);
+
+    // 唤醒所有等待者并拒绝之后的 Acquire
+    void Close();
+
+    // 上限减去已占用的字节数, 不限制时返回 INT64_MAX
+    int64_t Available() const;
+
+    int64_t Peak() const;
+
+    // Acquire 需要等待的次数
+    int Waits() const;
+
+private:
+    bool Fits(int64_t bytes) const;
+
+    mutable std::mutex mutex_;
+    std::condition_variable released_;
+    int64_t limit_ = 0;
+    int64_t in_use_ = 0;
+    int64_t peak_ = 0;
+    int waits_ = 0;
+    bool closed_ = false;
+};
@@ -0,0 +1,133 @@
+﻿#include "output_manifest.h"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+namespace
+{
+constexpr int kManifestVersion = 1;
+
+QString ToQString(const std::filesystem::path & path)
+{
+    const std::string text = path.string();
+    return QString::fromLocal8Bit(text.data(), static_cast<qsizetype>(text.size()));
+}
+}
+
+bool OutputManifest::Load(const std::filesystem::path & output_dir)
+{
+    std::lock_guard lock(mutex_);
+    file_ = output_dir / kFileName;
+    entries_.clear();
+    dirty_ = false;
+
+    QFile file(ToQString(file_));
+    if (!file.exists())
+        return true;
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Open manifest" << file.fileName() << "failed.";
+        return false;
+    }
+
+    QJsonParseError error;
+    const QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &error);
+    const QJsonObject root = doc.object();
+    if (error.error != QJsonParseError::NoError || root.value("version").toInt() != kManifestVersion)
+    {
+        qWarning() << "Ignore invalid manifest" << file.fileName();
+        return false;
+    }
+
+    const QJsonObject files = root.value("files").toObject();
+    entries_.reserve(files.size());
+    for (auto it = files.begin(); it != files.end(); ++it)
+    {
+        const QJsonObject item = it.value().toObject();
+        ManifestEntry entry;
+        // json 的数字为 double, 64 位整数用字符串保存
+        entry.size = item.value("size").toString().toLongLong();
+        entry.mtime = item.value("mtime").toString().toLongLong();
+        entry.hash = item.value("hash").toString().toLatin1();
+        entry.param_hash = item.value("param").toString().toLatin1();
+        entries_.emplace(it.key().toStdString(), std::move(entry));
+    }
+    return true;
+}
+
+bool OutputManifest::Save()
+{
+    std::lock_guard lock(mutex_);
+    if (!dirty_ || file_.empty())
+        return true;
+
+    QJsonObject files;
+    for (const auto & [key, entry] : entries_)
+    {
+        QJsonObject item;
+        item.insert("size", QString::number(entry.size));
+        item.insert("mtime", QString::number(entry.mtime));
+        item.insert("hash", QString::fromLatin1(entry.hash));
+        item.insert("param", QString::fromLatin1(entry.param_hash));
+        files.insert(QString::fromStdString(key), item);
+    }
+    QJsonObject root;
+    root.insert("version", kManifestVersion);
+    root.insert("files", files);
+
+    QSaveFile file(ToQString(file_));
+    if (!file.open(QIODevice::WriteOnly) ||
+        file.write(QJsonDocument(root).toJson(QJsonDocument::Compact)) < 0 ||
+        !file.commit())
+    {
+        qWarning() << "Write manifest" << file.fileName() << "failed.";
+        return false;
+    }
+    dirty_ = false;
+    return true;
+}
+
+bool OutputManifest::Find(const std::string & key, ManifestEntry & entry) const
+{
+    std::lock_guard lock(mutex_);
+    auto found = entries_.find(key);
+    if (found == entries_.end())
+        return false;
+    entry = found->second;
+    return true;
+}
+
+void OutputManifest::Update(const std::string & key, const ManifestEntry & entry)
+{
+    std::lock_guard lock(mutex_);
+    entries_[key] = entry;
+    dirty_ = true;
+}
+
+void OutputManifest::Clear()
+{
+    std::lock_guard lock(mutex_);
+    file_.clear();
+    entries_.clear();
+    dirty_ = false;
+}
+
+QByteArray OutputManifest::HashFile(const std::filesystem::path & path)
+{
+    QFile file(ToQString(path));
+    if (!file.open(QIODevice::ReadOnly))
+        return { };
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (!hash.addData(&file))
+        return { };
+    return hash.result().toHex();
+}
+
+QByteArray OutputManifest::HashData(const QByteArray & data)
+{
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex();
+}
@@ -0,0 +1,46 @@
+﻿#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <QByteArray>
+
+// 生成某个输出文件时源文件的状态与参数
+using ManifestEntry = struct ManifestEntry
+{
+    int64_t size = 0;
+    int64_t mtime = 0; // file_time_type 的计数值, 只用于比较
+    QByteArray hash; // 源文件内容的 sha1, 十六进制
+    QByteArray param_hash; // 影响输出的 WaterMarkParam 字段的 sha1, 十六进制
+};
+
+// 保存在输出目录中的清单, 记录每个输出文件对应的源文件, 再次处理时跳过没有变化的图片
+// 可以在读取线程与写入线程之间共享
+class OutputManifest
+{
+public:
+    static constexpr const char * kFileName = ".photo_watermark_manifest.json";
+
+    // 文件不存在时得到空清单, 文件损坏时清空并返回 false
+    bool Load(const std::filesystem::path & output_dir);
+
+    // 有修改时整体写入, 写入过程中失败不会破坏旧文件
+    bool Save();
+
+    bool Find(const std::string & key, ManifestEntry & entry) const;
+
+    void Update(const std::string & key, const ManifestEntry & entry);
+
+    void Clear();
+
+    static QByteArray HashFile(const std::filesystem::path & path);
+
+    static QByteArray HashData(const QByteArray & data);
+
+private:
+    mutable std::mutex mutex_;
+    std::filesystem::path file_;
+    std::unordered_map<std::string, ManifestEntry> entries_; // <相对输出目录的路径, entry>
+    bool dirty_ = false;
+};
@@ -1,15 +1,26 @@
 ﻿#include "photo_watermark.h"
+#include "bounded_queue.h"
 #include "exif.h"
+#include "exif_reader.h"
+#include "lossless_jpeg.h"
+#include "pixel_kernels.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <mutex>
+#include <numeric>
 #include <QImageReader>
+#include <QImageWriter>
 #include <QPainter>
 #include <QBuffer>
-#include <QLabel>
-#include <QVBoxLayout>
+#include <QFile>
+#include <QFontDatabase>
+#include <QtMath>
 
 #if defined(WIN32) || defined(_WIN32)
 #ifndef strcasecmp
@@ -18,12 +29,34 @@
 #endif
 #endif
 
+namespace
+{
+// 队列中只是路径, 可以比图片多缓存很多
+constexpr size_t kPathQueueCapacity = 4096;
+
+constexpr QRgb kCanvasColor = 0xFFFFFFFF;
+
+// 处理过程中定期保存清单, 异常退出时只丢失最近一段时间的记录
+constexpr auto kManifestSaveInterval = std::chrono::seconds(30);
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+}
+
 PhotoWaterMarkWork::PhotoWaterMarkWork()
 {
     const auto exe_path = GetSelfPath();
     self_dir_ = exe_path.parent_path();
 }
 
+PhotoWaterMarkWork::~PhotoWaterMarkWork()
+{
+    Cancel();
+    Wait();
+}
+
 bool PhotoWaterMarkWork::Init(const WaterMarkParam & param, progress_callback cb)
 {
     if (working_)
@@ -39,7 +72,7 @@ bool PhotoWaterMarkWork::Init(const WaterMarkParam & param, progress_callback cb
     }
 
     const std::filesystem::path input_dir(param.input_path);
-    if (!std::filesystem::exists(input_dir))
+    if (!std::filesystem::is_directory(input_dir))
     {
         qWarning() << "Input path :" << param.input_path.c_str() << " not exists.";
         return false;
@@ -52,35 +85,141 @@ bool PhotoWaterMarkWork::Init(const WaterMarkParam & param, progress_callback cb
         return false;
     }
 
-    // get all input file
-    for (const auto & file : std::filesystem::directory_iterator{ input_dir })
+    // 输入文件在 Work 中边扫描边处理
+    input_root_ = std::filesystem::absolute(input_dir).lexically_normal();
+    output_root_ = std::filesystem::absolute(output_dir).lexically_normal();
+
+    if (!LoadLogos())
+        qWarning() << "Load Logos failed.";
+
+    // 解码尺寸取所有输出中最大的一个
+    std::vector<Rendition> renditions = param.renditions;
+    if (renditions.empty())
+        renditions.emplace_back();
+    int decode_long_edge = 0;
+    for (size_t i = 0; i < renditions.size(); ++i)
     {
-        std::string ext = file.path().extension().string();
-        if (0 == strcasecmp(ext.c_str(), ".jpg") || 0 == strcasecmp(ext.c_str(), ".jpeg"))
-            input_files_.emplace_back(std::filesystem::absolute(file.path()).string());
+        for (size_t j = 0; j < i; ++j)
+        {
+            if (renditions[i].dir == renditions[j].dir)
+            {
+                qWarning() << "Renditions use the same directory :" << renditions[i].dir.c_str();
+                return false;
+            }
+        }
+        const QByteArray format = QByteArray::fromStdString(renditions[i].format).toLower();
+        if (!QImageWriter::supportedImageFormats().contains(format))
+        {
+            qWarning() << "Unsupported output format :" << renditions[i].format.c_str();
+            return false;
+        }
+        if (renditions[i].quality < 0 || renditions[i].quality > 100)
+        {
+            qWarning() << "Invalid output quality :" << renditions[i].quality;
+            return false;
+        }
+        if (UseLibjpeg(renditions[i]) && !JpegEncoderAvailable())
+        {
+            qWarning() << "Chroma subsampling and fast encode need libjpeg.";
+            return false;
+        }
+        if (renditions[i].long_edge <= 0 || decode_long_edge < 0)
+            decode_long_edge = -1;
+        else
+            decode_long_edge = std::max(decode_long_edge, renditions[i].long_edge);
     }
+    // 无损模式沿用原图的量化表、采样与编码方式, 编码参数只作用于需要旋转或缩放而无法无损处理的图片
+    if (param.lossless && std::ranges::any_of(renditions, [](const Rendition & rendition)
+                                              {
+                                                  return rendition.quality != Rendition().quality ||
+                                                      rendition.subsampling != ChromaSubsampling::kDefault ||
+                                                      rendition.progressive || rendition.optimize_huffman ||
+                                                      rendition.fast_encode;
+                                              }))
+        qWarning() << "Lossless output keeps the source JPEG encoding, encoder settings only apply to images "
+                      "that fall back to a full encode.";
+    renditions_ = std::move(renditions);
+    decode_long_edge_ = std::max(decode_long_edge, 0);
+
+    param_ = param;
+    param_hash_ = HashParam(param_);
+    text_renderer_.Init(param_.font, param_.text_settings, param_.auto_align);
+    // 多个节点同时写入同一个输出目录时清单由分块的完成标记代替
+    if (param_.input_files.empty())
+        manifest_.Load(output_dir);
+    // 每个阶段同时持有的缓冲不超过工作线程数加队列长度, 空闲缓冲与图片共用内存预算
+    buffer_pool_.Reset(static_cast<size_t>(GetWorkerCount() + std::max(param_.queue_capacity, 1)), &memory_budget_);
+    cb_ = cb;
+    return true;
+}
 
-    if (input_files_.empty())
+bool PhotoWaterMarkWork::InitPreview(const WaterMarkParam & param)
+{
+    if (working_)
     {
-        qWarning() << "Found valid image in path :" << param.input_path.c_str() << " failed.";
+        qWarning() << "Processing, can't init preview.";
         return false;
     }
 
-    if (!LoadLogos())
+    // logo 只加载一次, 调整设置时不再重新解码
+    if (logo_map_.empty() && !LoadLogos())
         qWarning() << "Load Logos failed.";
 
     param_ = param;
-    cb_ = cb;
+    param_.lossless = false;
+    text_renderer_.Init(param_.font, param_.text_settings, param_.auto_align);
+    renditions_.assign(1, Rendition());
+    buffer_pool_.Reset(1);
+    return true;
+}
+
+bool PhotoWaterMarkWork::DecodePreview(const std::string & image_path, int long_edge, QImage & source,
+                                       easyexif::EXIFInfo & exif)
+{
+    ImageTask task;
+    task.input_file = image_path;
+    if (!ReadStage(task))
+        return false;
+    if (PARSE_EXIF_SUCCESS != ParseExif(reinterpret_cast<const unsigned char *>(task.file_data.constData()),
+                                        static_cast<size_t>(task.file_data.size()), task.exif))
+    {
+        qWarning() << "Parse " << image_path.c_str() << " exif failed.";
+        ReleaseInput(task);
+        return false;
+    }
+
+    decode_long_edge_ = std::max(long_edge, 0);
+    if (!DecodeImage(task))
+        return false;
+    source = std::move(task.source_img);
+    exif = std::move(task.exif);
     return true;
 }
 
+bool PhotoWaterMarkWork::ComposePreview(const easyexif::EXIFInfo & exif, const QImage & source, QImage & preview)
+{
+    return ComposeOutput(exif, source, preview);
+}
+
 bool PhotoWaterMarkWork::WorkStart()
 {
-    if (input_files_.empty())
+    if (input_root_.empty())
+    {
+        qWarning() << "Not initialized.";
+        return false;
+    }
+    if (working_.exchange(true))
     {
-        qWarning() << "Empty input queue.";
+        qWarning() << "Processing, can't start again.";
         return false;
     }
+    if (thread_.joinable())
+        thread_.join();
+    cancelled_ = false;
+    {
+        std::lock_guard lock(pause_mutex_);
+        paused_ = false;
+    }
     try
     {
         thread_ = std::thread(&PhotoWaterMarkWork::Work, this);
@@ -88,288 +227,1186 @@ bool PhotoWaterMarkWork::WorkStart()
     catch (const std::exception & e)
     {
         qWarning() << "Open work thread error:" << e.what();
+        working_ = false;
+        return false;
     }
 
     return true;
 }
 
+void PhotoWaterMarkWork::Wait()
+{
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void PhotoWaterMarkWork::Cancel()
+{
+    {
+        std::lock_guard lock(pause_mutex_);
+        cancelled_ = true;
+    }
+    pause_cv_.notify_all();
+    // 读取线程可能在等待内存预算
+    memory_budget_.Close();
+}
+
+bool PhotoWaterMarkWork::IsCancelled() const
+{
+    return cancelled_;
+}
+
+void PhotoWaterMarkWork::Pause()
+{
+    std::lock_guard lock(pause_mutex_);
+    paused_ = true;
+}
+
+void PhotoWaterMarkWork::Resume()
+{
+    {
+        std::lock_guard lock(pause_mutex_);
+        paused_ = false;
+    }
+    pause_cv_.notify_all();
+}
+
+bool PhotoWaterMarkWork::IsPaused() const
+{
+    std::lock_guard lock(pause_mutex_);
+    return paused_;
+}
+
+bool PhotoWaterMarkWork::WaitIfPaused()
+{
+    std::unique_lock lock(pause_mutex_);
+    pause_cv_.wait(lock, [this] { return !paused_ || cancelled_; });
+    return !cancelled_;
+}
+
+void PhotoWaterMarkWork::LoadBundledFonts()
+{
+    const auto font_path(GetSelfPath().parent_path() / "font");
+    if (!std::filesystem::exists(font_path))
+        return;
+    for (auto & file : std::filesystem::directory_iterator(font_path))
+    {
+        auto id = QFontDatabase::addApplicationFont(std::filesystem::absolute(file).string().c_str());
+        if (id >= 0)
+            QFontDatabase::applicationFontFamilies(id);
+    }
+}
+
 void PhotoWaterMarkWork::Clean()
 {
     if (working_)
         return;
-    param_ = WaterMarkParam();
-    input_files_.clear();
-    logo_map_.clear();
     if (thread_.joinable())
         thread_.join();
+    param_ = WaterMarkParam();
+    input_root_.clear();
+    output_root_.clear();
+    renditions_.clear();
+    decode_long_edge_ = 0;
+    // logo 与参数无关, 保留到下一次 Init, 目录没有变化时不再解码
+    manifest_.Clear();
+    checkpoint_.Close();
+    param_hash_.clear();
 }
 
 void PhotoWaterMarkWork::Work()
 {
-    working_ = true;
-    int total = input_files_.size();
+    using TaskPtr = std::unique_ptr<ImageTask>;
+    using TaskQueue = BoundedQueue<TaskPtr>;
+
+    std::atomic_int total = 0;
     int cur = 0;
     int failed = 0;
-    for (auto & file : input_files_)
+    std::mutex progress_mutex;
+
+    auto report = [&](bool ok)
     {
+        std::lock_guard lock(progress_mutex);
         ++cur;
+        if (!ok)
+            ++failed;
         if (cb_)
-            cb_(cur, failed, total, false);
-        if (!ImageProcessing(file))
+            cb_(cur, failed, total.load(), false, metrics_);
+    };
+
+    auto complete = [&](const ImageTask & task)
+    {
+        memory_budget_.Release(task.memory_cost);
+        metrics_.AddImage(true);
+        report(true);
+    };
+
+    auto fail = [&](const ImageTask & task, MetricStage stage)
+    {
+        qWarning() << "Process file " << task.input_file.c_str() << "failed in" << PipelineMetrics::StageName(stage)
+            << ":" << task.error.c_str();
+        metrics_.AddFailure(task.input_file, stage, task.error);
+        memory_budget_.Release(task.memory_cost);
+        metrics_.AddImage(false);
+        report(false);
+    };
+
+    auto skip = [&]
+    {
+        metrics_.AddSkipped();
+        report(true);
+    };
+
+    // 取消后剩余的图片直接丢弃, 不计入失败
+    auto discard = [&](const ImageTask & task)
+    {
+        memory_budget_.Release(task.memory_cost);
+    };
+
+    // 阶段之间用有界队列连接, 下游阻塞时上游随之等待, 内存占用不会无限增长
+    const size_t capacity = static_cast<size_t>(std::max(param_.queue_capacity, 1));
+    TaskQueue decode_queue(capacity);
+    TaskQueue compose_queue(capacity);
+    TaskQueue encode_queue(capacity);
+    TaskQueue write_queue(capacity);
+
+    auto run_stage = [&](TaskQueue & in, TaskQueue * out, auto stage, MetricStage metric)
+    {
+        TaskPtr task;
+        while (in.Pop(task))
         {
-            qWarning() << "Process file " << file.c_str() << "failed.";
-            ++failed;
+            if (!WaitIfPaused())
+            {
+                discard(*task);
+                continue;
+            }
+            const auto start = std::chrono::steady_clock::now();
+            const bool ok = std::invoke(stage, this, *task);
+            metrics_.AddLatency(metric, MillisecondsSince(start));
+            if (!ok)
+                fail(*task, metric);
+            else if (nullptr == out)
+                complete(*task);
+            else if (!out->Push(std::move(task)))
+            {
+                task->error = "pipeline closed";
+                fail(*task, metric);
+            }
+        }
+    };
+
+    auto spawn = [&](std::vector<std::thread> & threads, int count, TaskQueue & in, auto fn)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            try
+            {
+                threads.emplace_back(fn);
+            }
+            catch (const std::exception & e)
+            {
+                qWarning() << "Open pipeline thread error:" << e.what();
+                break;
+            }
+        }
+        // 一个线程都没有时关闭输入队列, 让上游直接失败而不是阻塞
+        if (threads.empty())
+            in.Close();
+    };
+
+    const int worker_count = GetWorkerCount();
+    std::vector<std::thread> decoders;
+    std::vector<std::thread> composers;
+    std::vector<std::thread> encoders;
+    std::vector<std::thread> writers;
+    spawn(writers, 1, write_queue,
+          [&] { run_stage(write_queue, nullptr, &PhotoWaterMarkWork::WriteStage, MetricStage::kWrite); });
+    spawn(encoders, worker_count, encode_queue,
+          [&] { run_stage(encode_queue, &write_queue, &PhotoWaterMarkWork::EncodeStage, MetricStage::kEncode); });
+    spawn(composers, worker_count, compose_queue,
+          [&] { run_stage(compose_queue, &encode_queue, &PhotoWaterMarkWork::ComposeStage, MetricStage::kCompose); });
+    spawn(decoders, worker_count, decode_queue,
+          [&] { run_stage(decode_queue, &compose_queue, &PhotoWaterMarkWork::DecodeStage, MetricStage::kDecode); });
+
+    metrics_.Reset();
+    manifest_saved_ = std::chrono::steady_clock::now();
+    memory_budget_.Reset(param_.memory_budget);
+    // 取消可能发生在 Reset 之前
+    if (cancelled_)
+        memory_budget_.Close();
+    const bool shared_output = !param_.input_files.empty();
+    const bool checkpoint = !param_.dry_run && !shared_output &&
+        checkpoint_.Open(output_root_, param_hash_, param_.resume);
+    if (checkpoint && checkpoint_.Size() > 0)
+        qInfo() << "Resume from checkpoint," << checkpoint_.Size() << "images done.";
+
+    // 扫描线程找到文件后立即交给读取阶段, 不需要等待整个目录遍历结束
+    BoundedQueue<std::string> path_queue(kPathQueueCapacity);
+    std::thread discover_thread;
+    try
+    {
+        discover_thread = std::thread([&]
+        {
+            DiscoverInputs([&](std::string file)
+            {
+                ++total;
+                return path_queue.Push(std::move(file));
+            });
+            path_queue.Close();
+        });
+    }
+    catch (const std::exception & e)
+    {
+        qWarning() << "Open discover thread error:" << e.what();
+        path_queue.Close();
+    }
+
+    // 读取阶段在当前线程执行, dry run 时只读取文件头的 exif
+    int skipped = 0;
+    std::string file;
+    while (WaitIfPaused() && path_queue.Pop(file))
+    {
+        auto task = std::make_unique<ImageTask>();
+        task->input_file = file;
+        if (param_.dry_run)
+        {
+            if (ScanStage(*task))
+                complete(*task);
+            else
+                fail(*task, MetricStage::kRead);
+        }
+        else if (checkpoint && checkpoint_.Contains(GetRelativePath(file).generic_string()))
+        {
+            ++skipped;
+            skip();
+        }
+        else if (!StatSource(*task))
+            fail(*task, MetricStage::kRead);
+        else if (param_.incremental && IsUpToDate(*task))
+        {
+            ++skipped;
+            skip();
+        }
+        else if (const auto start = std::chrono::steady_clock::now(); !ReadStage(*task))
+            fail(*task, MetricStage::kRead);
+        else
+        {
+            metrics_.AddLatency(MetricStage::kRead, MillisecondsSince(start));
+            metrics_.AddBytesRead(task->file_data.size());
+            if (!AcquireMemory(*task))
+                discard(*task);
+            else if (!decode_queue.Push(std::move(task)))
+            {
+                task->error = "pipeline closed";
+                fail(*task, MetricStage::kRead);
+            }
         }
     }
+    // 取消时让扫描线程停止
+    path_queue.Close();
+
+    if (discover_thread.joinable())
+        discover_thread.join();
+    if (0 == total && !cancelled_)
+        qWarning() << "Found valid image in path :" << param_.input_path.c_str() << " failed.";
+
+    auto drain = [](TaskQueue & queue, std::vector<std::thread> & threads)
+    {
+        queue.Close();
+        for (auto & t : threads)
+            t.join();
+    };
+    drain(decode_queue, decoders);
+    drain(compose_queue, composers);
+    drain(encode_queue, encoders);
+    drain(write_queue, writers);
+
+    if (!param_.dry_run)
+    {
+        if (skipped > 0)
+            qInfo() << "Skipped" << skipped << "up-to-date or checkpointed images.";
+        if (param_.memory_budget > 0)
+            qInfo() << "Estimated image memory peak:" << memory_budget_.Peak() / (1024 * 1024) << "MiB, waits:"
+                << memory_budget_.Waits();
+        if (!shared_output)
+            manifest_.Save();
+        if (checkpoint && cancelled_)
+        {
+            qInfo() << "Cancelled," << checkpoint_.Size() << "images in checkpoint.";
+            checkpoint_.Close();
+        }
+        else if (checkpoint)
+        {
+            checkpoint_.Remove();
+        }
+    }
+
+    const auto cache_stats = text_renderer_.GetCacheStats();
+    qInfo() << "Text cache hits:" << cache_stats.hits << "misses:" << cache_stats.misses;
+    for (int kind = 0; kind < static_cast<int>(PoolKind::kCount); ++kind)
+    {
+        const auto pool_stats = buffer_pool_.Stats(static_cast<PoolKind>(kind));
+        qInfo() << "Buffer pool" << BufferPool::KindName(static_cast<PoolKind>(kind)) << "hits:" << pool_stats.hits
+            << "misses:" << pool_stats.misses;
+    }
+    buffer_pool_.Trim();
+
+    const MetricsSnapshot metrics = metrics_.Snapshot();
+    for (int stage = 0; stage < static_cast<int>(MetricStage::kCount); ++stage)
+    {
+        const auto & histogram = metrics.stages[stage];
+        if (histogram.count > 0)
+            qInfo() << "Stage" << PipelineMetrics::StageName(static_cast<MetricStage>(stage)) << "mean:"
+                << histogram.total_ms / static_cast<double>(histogram.count) << "ms p90:" << histogram.Percentile(0.9)
+                << "ms max:" << histogram.max_ms << "ms";
+    }
+    qInfo() << "Processed" << metrics.images_done + metrics.images_failed << "images," << metrics.images_per_second
+        << "images/s, read" << metrics.bytes_read << "bytes, wrote" << metrics.bytes_written << "bytes.";
+    if (!param_.metrics_path.empty())
+        PipelineMetrics::Export(metrics, param_.metrics_path);
+
     if (cb_)
-        cb_(cur, failed, total, true);
+        cb_(cur, failed, total.load(), true, metrics_);
     working_ = false;
 }
 
+int PhotoWaterMarkWork::GetWorkerCount() const
+{
+    int count = param_.thread_count;
+    if (count <= 0)
+        count = static_cast<int>(std::thread::hardware_concurrency());
+    if (count <= 0)
+        count = 1;
+    return count;
+}
+
+std::vector<std::string> PhotoWaterMarkWork::ListInputs() const
+{
+    std::vector<std::string> files;
+    DiscoverInputs([this, &files](std::string file)
+    {
+        files.push_back(GetRelativePath(file).generic_string());
+        return true;
+    });
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+void PhotoWaterMarkWork::DiscoverInputs(const std::function<bool(std::string)> & emit) const
+{
+    // 分布式处理时只处理领取到的分块
+    if (!param_.input_files.empty())
+    {
+        for (const auto & file : param_.input_files)
+        {
+            if (!emit((input_root_ / std::filesystem::path(file)).string()))
+                return;
+        }
+        return;
+    }
+
+    using std::filesystem::directory_options;
+    std::error_code ec;
+    std::filesystem::recursive_directory_iterator it(input_root_, directory_options::skip_permission_denied, ec);
+    for (; !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+    {
+        std::error_code type_ec;
+        if (it->is_directory(type_ec))
+        {
+            // 输出目录在输入目录中时不处理已经生成的图片
+            if (!param_.recursive || std::filesystem::equivalent(it->path(), output_root_, type_ec))
+                it.disable_recursion_pending();
+            continue;
+        }
+        if (!it->is_regular_file(type_ec))
+            continue;
+        const std::string ext = it->path().extension().string();
+        if (0 != strcasecmp(ext.c_str(), ".jpg") && 0 != strcasecmp(ext.c_str(), ".jpeg"))
+            continue;
+        if (!emit(it->path().string()))
+            return;
+    }
+    if (ec)
+        qWarning() << "Scan " << input_root_.string().c_str() << "failed:" << ec.message().c_str();
+}
+
 bool PhotoWaterMarkWork::ImageProcessing(const std::string & image_path)
 {
-    // 读取exif
-    std::ifstream ifs(image_path, std::ios::in | std::ios::binary);
+    ImageTask task;
+    task.input_file = image_path;
+    return ReadStage(task) && DecodeStage(task) && ComposeStage(task) &&
+        EncodeStage(task) && WriteStage(task);
+}
+
+bool PhotoWaterMarkWork::ReadStage(ImageTask & task) const
+{
+    if (param_.use_mmap && MapInput(task))
+        return true;
+
+    std::ifstream ifs(task.input_file, std::ios::in | std::ios::binary);
     if (!ifs.good())
     {
-        qWarning() << "Open " << image_path.c_str() << "failed.";
+        qWarning() << "Open " << task.input_file.c_str() << "failed.";
+        task.error = "open failed";
         return false;
     }
     ifs.seekg(0, std::ios::end);
     const qsizetype file_size = ifs.tellg();
-    QByteArray image_data(file_size, 0);
-    if (image_data.isNull())
+    task.file_data = buffer_pool_.AcquireBytes(PoolKind::kInput, file_size);
+    if (task.file_data.size() != file_size)
     {
-        qWarning() << "Create " << ifs.tellg() << " bytes buffer failed.";
+        qWarning() << "Create " << file_size << " bytes buffer failed.";
+        task.error = "allocate input buffer failed";
         return false;
     }
     ifs.seekg(0, std::ios::beg);
-    ifs.read(image_data.data(), file_size);
+    ifs.read(task.file_data.data(), file_size);
     ifs.close();
+    return true;
+}
 
-    easyexif::EXIFInfo exif;
-    exif.clear();
-    if (PARSE_EXIF_SUCCESS != exif.parseFrom(reinterpret_cast<unsigned char *>(image_data.data()),
-                                             static_cast<unsigned>(file_size)))
-    {
-        qWarning() << "Parse " << image_path.c_str() << " exif failed.";
+bool PhotoWaterMarkWork::MapInput(ImageTask & task) const
+{
+    auto file = std::make_unique<QFile>(QString::fromLocal8Bit(task.input_file.data(),
+                                                               static_cast<qsizetype>(task.input_file.size())));
+    if (!file->open(QIODevice::ReadOnly))
+        return false;
+    const qint64 file_size = file->size();
+    if (file_size <= 0)
+        return false;
+    const uchar * data = file->map(0, file_size);
+    if (nullptr == data)
         return false;
-    }
+
+    // fromRawData 不拷贝数据, 映射需要保持到解码结束
+    task.file_data = QByteArray::fromRawData(reinterpret_cast<const char *>(data),
+                                             static_cast<qsizetype>(file_size));
+    task.mapped_file = std::move(file);
+    return true;
+}
+
+int64_t PhotoWaterMarkWork::EstimateMemory(const ImageTask & task) const
+{
+    // 不限制时不需要再解析一次文件头
+    if (param_.memory_budget <= 0)
+        return 0;
+
+    // 映射的文件页可以被系统回收, 不计入
+    const int64_t input = task.mapped_file ? 0 : task.file_data.size();
 
     QBuffer buffer;
-    buffer.setData(image_data);
+    buffer.setData(task.file_data);
     buffer.open(QIODevice::ReadOnly);
     QImageReader image_reader(&buffer);
-    image_reader.setAutoTransform(true);
-    QImage source_img = image_reader.read();
+    QSize size = image_reader.size();
+    if (!size.isValid())
+        return input;
+    if (decode_long_edge_ > 0 && std::max(size.width(), size.height()) > decode_long_edge_)
+        size = ScaleToLongEdge(size, decode_long_edge_);
 
-    if (source_img.isNull())
+    // 解码结果按 4 字节每像素计算, 旋转与格式转换时会短暂存在第二份
+    constexpr int64_t kPixelBytes = 4;
+    const int64_t decoded = static_cast<int64_t>(size.width()) * size.height() * kPixelBytes;
+    const CanvasLayout layout = GetCanvasLayout(size.width(), size.height());
+    const int64_t master = static_cast<int64_t>(layout.width) * layout.height * kPixelBytes;
+    const int source_long_edge = std::max(size.width(), size.height());
+    int64_t canvases = master;
+    for (const auto & rendition : renditions_)
+    {
+        if (rendition.long_edge > 0 && rendition.long_edge < source_long_edge)
+        {
+            const double factor = static_cast<double>(rendition.long_edge) / source_long_edge;
+            canvases += static_cast<int64_t>(static_cast<double>(master) * factor * factor);
+        }
+    }
+    // 编码结果按画布的 1/4 估算
+    return input + 2 * decoded + canvases + canvases / 4;
+}
+
+bool PhotoWaterMarkWork::AcquireMemory(ImageTask & task)
+{
+    const int64_t cost = EstimateMemory(task);
+    // 需要等待时先释放所有空闲缓冲, 新图片的尺寸可能与它们不同
+    if (!memory_budget_.TryAcquire(cost))
     {
-        qWarning() << "QImage open" << image_path.c_str() << "failed.";
+        buffer_pool_.Trim();
+        if (!memory_budget_.Acquire(cost))
+            return false;
+    }
+    // 空闲缓冲只能使用预算中剩下的部分
+    buffer_pool_.TrimTo(memory_budget_.Available());
+    task.memory_cost = cost;
+    return true;
+}
+
+void PhotoWaterMarkWork::ReleaseInput(ImageTask & task) const
+{
+    // 先释放引用映射内存的 QByteArray, 再解除映射
+    if (task.mapped_file)
+        task.file_data = QByteArray();
+    else
+        buffer_pool_.ReleaseBytes(PoolKind::kInput, std::move(task.file_data));
+    task.mapped_file.reset();
+}
+
+bool PhotoWaterMarkWork::ScanStage(ImageTask & task) const
+{
+    if (PARSE_EXIF_SUCCESS != ReadExif(task.input_file, task.exif))
+    {
+        qWarning() << "Parse " << task.input_file.c_str() << " exif failed.";
+        task.error = "parse exif failed";
         return false;
     }
+    const LogoImage * logo = FindLogo(task.exif);
+    qInfo() << task.input_file.c_str() << ":" << task.exif.Make.c_str() << task.exif.Model.c_str()
+        << "logo:" << (nullptr == logo ? "none" : logo->path.c_str());
+    return true;
+}
 
-    // 新建图片
+bool PhotoWaterMarkWork::DecodeStage(ImageTask & task) const
+{
+    HashSource(task);
+
+    // 读取exif
+    if (PARSE_EXIF_SUCCESS != ParseExif(reinterpret_cast<const unsigned char *>(task.file_data.constData()),
+                                        static_cast<size_t>(task.file_data.size()), task.exif))
+    {
+        qWarning() << "Parse " << task.input_file.c_str() << " exif failed.";
+        task.error = "parse exif failed";
+        ReleaseInput(task);
+        return false;
+    }
+
+    // 无损模式不解码, 原始数据保留到编码阶段
+    if (param_.lossless && PrepareLossless(task))
+        return true;
+
+    return DecodeImage(task);
+}
+
+bool PhotoWaterMarkWork::DecodeImage(ImageTask & task) const
+{
+    {
+        QBuffer buffer;
+        buffer.setData(task.file_data);
+        buffer.open(QIODevice::ReadOnly);
+        QImageReader image_reader(&buffer);
+        image_reader.setAutoTransform(true);
+        // 只需要较小的输出时, jpeg 插件会先在 DCT 域按 1/2, 1/4, 1/8 缩小再缩放到目标尺寸
+        const QSize stored_size = image_reader.size();
+        QSize decode_size = stored_size;
+        if (decode_long_edge_ > 0 && stored_size.isValid() &&
+            std::max(stored_size.width(), stored_size.height()) > decode_long_edge_)
+        {
+            decode_size = ScaleToLongEdge(stored_size, decode_long_edge_);
+            image_reader.setScaledSize(decode_size);
+        }
+        // 尺寸与格式相同时 jpeg 插件直接解码到传入的图片中, 需要旋转的图片仍会生成新的一张
+        QImage target;
+        if (decode_size.isValid())
+            target = buffer_pool_.AcquireImage(PoolKind::kDecode, decode_size, image_reader.imageFormat());
+        if (!image_reader.read(&target))
+        {
+            target = QImage();
+            task.error = "decode failed: " + image_reader.errorString().toStdString();
+        }
+        task.source_img = std::move(target);
+    }
+    ReleaseInput(task);
+
+    if (task.source_img.isNull())
+    {
+        qWarning() << "QImage open" << task.input_file.c_str() << "failed.";
+        if (task.error.empty())
+            task.error = "decode failed";
+        return false;
+    }
+    return true;
+}
+
+bool PhotoWaterMarkWork::PrepareLossless(ImageTask & task) const
+{
+    // 需要旋转或缩小的图片无法直接复制系数
+    if (task.exif.Orientation > 1)
+        return false;
+    // 边框按原图的量化表编码, 不使用输出的 quality
+    if (std::ranges::any_of(renditions_, [](const Rendition & rendition)
+                            { return rendition.long_edge > 0 || !IsJpegFormat(rendition.format); }))
+        return false;
+    int mcu_width = 0;
+    int mcu_height = 0;
+    if (!ReadLosslessGeometry(task.file_data, task.source_width, task.source_height, mcu_width, mcu_height))
+        return false;
+    task.mcu_size = std::lcm(mcu_width, mcu_height);
+    task.lossless = true;
+    return true;
+}
+
+int PhotoWaterMarkWork::GetBorderSize(int width, int height) const
+{
     //TODO 若横竖比过大, 可能导致比例失调
-    int border_size = static_cast<int>(static_cast<float>(
-        std::max(source_img.width(), source_img.height()) * param_.border_ratio));
-    int new_image_width = 0;
-    int new_image_height = 0;
-    int watermark_height = 4 * border_size;
+    return static_cast<int>(static_cast<float>(std::max(width, height) * param_.border_ratio));
+}
+
+QSize PhotoWaterMarkWork::ScaleToLongEdge(const QSize & size, int long_edge)
+{
+    const qreal factor = static_cast<qreal>(long_edge) / std::max(size.width(), size.height());
+    return QSize(std::max(1, qRound(size.width() * factor)), std::max(1, qRound(size.height() * factor)));
+}
+
+CanvasLayout PhotoWaterMarkWork::GetCanvasLayout(int width, int height) const
+{
+    CanvasLayout layout;
+    layout.border_size = GetBorderSize(width, height);
+    layout.watermark_height = 4 * layout.border_size;
     if (param_.add_frame)
     {
-        new_image_width = static_cast<int>(source_img.width() + 2 * border_size);
-        new_image_height = static_cast<int>(source_img.height() + watermark_height + border_size);
+        layout.width = width + 2 * layout.border_size;
+        layout.height = height + layout.watermark_height + layout.border_size;
+        layout.source_x = layout.border_size;
+        layout.source_y = layout.border_size;
     }
     else
     {
-        new_image_width = source_img.width();
-        new_image_height = source_img.height() + watermark_height;
+        layout.width = width;
+        layout.height = height + layout.watermark_height;
     }
+    layout.watermark_y = layout.source_y + height;
+    layout.text_x = param_.add_frame ? 2 * layout.border_size : layout.border_size;
+    return layout;
+}
 
-    QImage img(new_image_width, new_image_height, QImage::Format_ARGB32);
-    img.fill(QColor(255, 255, 255));
+bool PhotoWaterMarkWork::CreateCanvas(QImage & canvas, const QImage & source, const CanvasLayout & layout) const
+{
+    // jpeg 没有透明通道, 使用 RGB32 并且每个像素只写一次:
+    // 边框与水印区域填充白色, 原图逐行复制, 不需要整图填充后再混合绘制
+    QImage & img = canvas;
+    img = buffer_pool_.AcquireImage(PoolKind::kCanvas, QSize(layout.width, layout.height), QImage::Format_RGB32);
+    if (img.isNull())
+    {
+        qWarning() << "Create" << layout.width << "x" << layout.height << "canvas failed.";
+        return false;
+    }
+    // 解码结果常见的格式直接逐行转换到画布中, 其余格式先整体转换
+    QImage rgb = source;
+    switch (rgb.format())
+    {
+    case QImage::Format_RGB32:
+    case QImage::Format_RGB888:
+    case QImage::Format_Grayscale8:
+        break;
+    default:
+        rgb = source.convertToFormat(QImage::Format_RGB32);
+        break;
+    }
+    if (rgb.isNull())
+        return false;
 
-    QPainter img_painter;
-    img_painter.begin(&img);
-    if (param_.add_frame)
-        img_painter.drawImage(border_size, border_size, source_img);
-    else
-        img_painter.drawImage(0, 0, source_img);
+    const QImage::Format format = rgb.format();
+    const size_t width = static_cast<size_t>(rgb.width());
+    const int source_right = layout.source_x + rgb.width();
+    const int source_bottom = layout.source_y + rgb.height();
+    for (int y = 0; y < layout.height; ++y)
+    {
+        auto * line = reinterpret_cast<uint32_t *>(img.scanLine(y));
+        if (y < layout.source_y || y >= source_bottom)
+        {
+            FillRgb32(line, layout.width, kCanvasColor);
+            continue;
+        }
+        FillRgb32(line, layout.source_x, kCanvasColor);
+        const uchar * src = rgb.constScanLine(y - layout.source_y);
+        if (format == QImage::Format_RGB888)
+            Rgb888ToRgb32(line + layout.source_x, src, width);
+        else if (format == QImage::Format_Grayscale8)
+            Gray8ToRgb32(line + layout.source_x, src, width);
+        else
+            CopyRgb32(line + layout.source_x, reinterpret_cast<const uint32_t *>(src), width);
+        FillRgb32(line + source_right, layout.width - source_right, kCanvasColor);
+    }
+    return true;
+}
+
+bool PhotoWaterMarkWork::ComposeStage(ImageTask & task)
+{
+    if (task.lossless)
+        return ComposeLosslessStage(task);
+
+    // 水印只排版一次, 较小的输出从合成好的大图整体缩放得到
+    const int source_long_edge = std::max(task.source_img.width(), task.source_img.height());
+    QImage master;
+    if (!ComposeOutput(task.exif, task.source_img, master))
+    {
+        task.error = "create canvas failed";
+        return false;
+    }
+    buffer_pool_.ReleaseImage(PoolKind::kDecode, std::move(task.source_img));
+    task.source_img = QImage();
 
-    int watermark_y = param_.add_frame ? border_size + source_img.height() : source_img.size().height();
-    int left_draw_x = param_.add_frame ? 2 * border_size : border_size;
+    task.outputs.resize(renditions_.size());
+    for (size_t i = 0; i < renditions_.size(); ++i)
+    {
+        auto & output = task.outputs[i];
+        output.rendition = i;
+        const int long_edge = renditions_[i].long_edge;
+        if (long_edge <= 0 || source_long_edge <= long_edge)
+        {
+            output.canvas = master; // 隐式共享, 不会复制
+            continue;
+        }
+        const qreal factor = static_cast<qreal>(long_edge) / source_long_edge;
+        const QSize size(std::max(1, qRound(master.width() * factor)), std::max(1, qRound(master.height() * factor)));
+        output.canvas = master.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        output.scaled = true;
+        if (output.canvas.isNull())
+        {
+            qWarning() << "Scale" << task.input_file.c_str() << "to" << size << "failed.";
+            task.error = "scale rendition failed";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PhotoWaterMarkWork::ComposeOutput(const easyexif::EXIFInfo & exif, const QImage & source, QImage & canvas)
+{
+    const CanvasLayout layout = GetCanvasLayout(source.width(), source.height());
+    if (!CreateCanvas(canvas, source, layout))
+        return false;
 
-    img_painter.translate(0, watermark_y);
-    PaintLeft(&img_painter, exif, left_draw_x, watermark_height, border_size);
-    PaintRight(&img_painter, exif, new_image_width, watermark_height, border_size);
+    QPainter img_painter;
+    img_painter.begin(&canvas);
+    img_painter.translate(0, layout.watermark_y);
+    PaintLeft(&img_painter, exif, layout.text_x, layout.watermark_height, layout.border_size);
+    PaintRight(&img_painter, exif, layout.width, layout.watermark_height, layout.border_size);
     img_painter.end();
+    return true;
+}
+
+bool PhotoWaterMarkWork::ComposeLosslessStage(ImageTask & task)
+{
+    // 边框取整到 MCU 的倍数, 原图与水印区域才能按块拼接
+    const int mcu = task.mcu_size;
+    const int border_size = std::max(mcu, (GetBorderSize(task.source_width, task.source_height) + mcu / 2) / mcu * mcu);
+    const int watermark_height = 4 * border_size;
+    auto & layout = task.lossless_layout;
+    layout.source_x = param_.add_frame ? border_size : 0;
+    layout.source_y = layout.source_x;
+    layout.output_width = task.source_width + 2 * layout.source_x;
+    layout.output_height = task.source_height + watermark_height + layout.source_y;
+
+    LosslessStrip strip;
+    strip.y = layout.source_y + task.source_height;
+    strip.image = QImage(layout.output_width, watermark_height, QImage::Format_RGB32);
+    if (strip.image.isNull())
+    {
+        qWarning() << "Create" << layout.output_width << "x" << watermark_height << "watermark strip failed.";
+        task.error = "create watermark strip failed";
+        return false;
+    }
+    strip.image.fill(QColor(255, 255, 255));
 
-    std::filesystem::path out_file(param_.output_path);
-    out_file /= std::filesystem::path(image_path).filename();
-    img.save(QString::fromLocal8Bit(out_file.string().data(), out_file.string().size()), "JPG", 100);
+    QPainter painter;
+    painter.begin(&strip.image);
+    const int left_draw_x = param_.add_frame ? 2 * border_size : border_size;
+    PaintLeft(&painter, task.exif, left_draw_x, watermark_height, border_size);
+    PaintRight(&painter, task.exif, layout.output_width, watermark_height, border_size);
+    painter.end();
 
+    layout.strips.clear();
+    layout.strips.emplace_back(std::move(strip));
     return true;
 }
 
+bool PhotoWaterMarkWork::EncodeStage(ImageTask & task) const
+{
+    if (task.lossless)
+    {
+        QByteArray encoded;
+        const bool composed = ComposeLosslessJpeg(task.file_data, task.lossless_layout, encoded);
+        ReleaseInput(task);
+        task.lossless_layout = LosslessLayout();
+        if (!composed)
+        {
+            qWarning() << "Lossless encode " << task.input_file.c_str() << "failed.";
+            task.error = "lossless encode failed";
+            return false;
+        }
+        // 无损模式下所有输出都是原图尺寸, 共享同一份数据
+        task.outputs.resize(renditions_.size());
+        for (size_t i = 0; i < renditions_.size(); ++i)
+        {
+            task.outputs[i].rendition = i;
+            task.outputs[i].encoded = encoded;
+        }
+        return true;
+    }
+
+    for (auto & output : task.outputs)
+    {
+        const bool ok = EncodeOutput(output);
+        // 共享同一张画布的输出中最后一个放回缓冲池
+        if (!output.scaled)
+            buffer_pool_.ReleaseImage(PoolKind::kCanvas, std::move(output.canvas));
+        output.canvas = QImage();
+        if (!ok)
+        {
+            qWarning() << "Encode " << task.input_file.c_str() << "failed.";
+            task.error = "encode " + renditions_[output.rendition].format + " failed";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PhotoWaterMarkWork::EncodeOutput(ImageOutput & output) const
+{
+    const auto & rendition = renditions_[output.rendition];
+    // 预留画布的 1/4, 大多数照片编码时不需要扩容
+    output.encoded = buffer_pool_.AcquireBytes(PoolKind::kEncode, 0, output.canvas.sizeInBytes() / 4);
+    if (UseLibjpeg(rendition))
+    {
+        JpegEncodeOptions options;
+        options.quality = rendition.quality;
+        options.subsampling = rendition.subsampling;
+        options.progressive = rendition.progressive;
+        options.optimize_huffman = rendition.optimize_huffman;
+        return EncodeJpeg(output.canvas, options, output.encoded);
+    }
+
+    QBuffer buffer(&output.encoded);
+    buffer.open(QIODevice::WriteOnly);
+    QImageWriter writer(&buffer, QByteArray::fromStdString(rendition.format));
+    writer.setQuality(rendition.quality);
+    if (IsJpegFormat(rendition.format))
+    {
+        writer.setProgressiveScanWrite(rendition.progressive);
+        writer.setOptimizedWrite(rendition.optimize_huffman);
+    }
+    const bool ok = writer.write(output.canvas);
+    buffer.close();
+    return ok;
+}
+
+bool PhotoWaterMarkWork::UseLibjpeg(const Rendition & rendition)
+{
+    return IsJpegFormat(rendition.format) &&
+        (rendition.fast_encode || rendition.subsampling != ChromaSubsampling::kDefault);
+}
+
+bool PhotoWaterMarkWork::WriteStage(ImageTask & task)
+{
+    const std::filesystem::path relative_path = GetRelativePath(task.input_file);
+    for (auto & output : task.outputs)
+    {
+        const std::filesystem::path out_file = GetOutputPath(renditions_[output.rendition], relative_path);
+        std::error_code ec;
+        std::filesystem::create_directories(out_file.parent_path(), ec);
+        QFile file(QString::fromLocal8Bit(out_file.string().data(), out_file.string().size()));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+            file.write(output.encoded) != output.encoded.size())
+        {
+            qWarning() << "Write " << out_file.string().c_str() << "failed.";
+            task.error = "write failed: " + file.errorString().toStdString();
+            return false;
+        }
+        file.close();
+        metrics_.AddBytesWritten(output.encoded.size());
+        buffer_pool_.ReleaseBytes(PoolKind::kEncode, std::move(output.encoded));
+        output.encoded = QByteArray();
+    }
+    task.outputs.clear();
+
+    if (param_.input_files.empty())
+    {
+        task.source.param_hash = param_hash_;
+        manifest_.Update(relative_path.generic_string(), task.source);
+        if (std::chrono::steady_clock::now() - manifest_saved_ >= kManifestSaveInterval)
+        {
+            manifest_.Save();
+            manifest_saved_ = std::chrono::steady_clock::now();
+        }
+    }
+    checkpoint_.Add(relative_path.generic_string());
+    return true;
+}
+
+std::filesystem::path PhotoWaterMarkWork::GetRelativePath(const std::string & input_file) const
+{
+    // 保持输入目录的层级结构
+    const std::filesystem::path path(input_file);
+    std::filesystem::path relative_path = path.lexically_relative(input_root_);
+    if (relative_path.empty() || *relative_path.begin() == "..")
+        return path.filename();
+    return relative_path;
+}
+
+std::filesystem::path PhotoWaterMarkWork::GetOutputPath(const Rendition & rendition,
+                                                        const std::filesystem::path & relative_path) const
+{
+    std::filesystem::path path = rendition.dir.empty() ? output_root_ / relative_path
+                                                       : output_root_ / rendition.dir / relative_path;
+    if (!IsJpegFormat(rendition.format))
+        path.replace_extension("." + rendition.format);
+    return path;
+}
+
+bool PhotoWaterMarkWork::IsJpegFormat(const std::string & format)
+{
+    return 0 == strcasecmp(format.c_str(), "jpg") || 0 == strcasecmp(format.c_str(), "jpeg");
+}
+
+bool PhotoWaterMarkWork::StatSource(ImageTask & task) const
+{
+    std::error_code ec;
+    const std::filesystem::path path(task.input_file);
+    const auto size = std::filesystem::file_size(path, ec);
+    if (ec)
+    {
+        qWarning() << "Stat " << task.input_file.c_str() << "failed:" << ec.message().c_str();
+        task.error = "stat failed: " + ec.message();
+        return false;
+    }
+    const auto mtime = std::filesystem::last_write_time(path, ec);
+    if (ec)
+    {
+        qWarning() << "Stat " << task.input_file.c_str() << "failed:" << ec.message().c_str();
+        task.error = "stat failed: " + ec.message();
+        return false;
+    }
+    task.source.size = static_cast<int64_t>(size);
+    task.source.mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+    return true;
+}
+
+void PhotoWaterMarkWork::HashSource(ImageTask & task) const
+{
+    if (!param_.input_files.empty())
+        return;
+    // 只是参数变化或输出被删除时源文件没有变化, 不需要重新计算
+    ManifestEntry entry;
+    if (manifest_.Find(GetRelativePath(task.input_file).generic_string(), entry) && !entry.hash.isEmpty() &&
+        entry.size == task.source.size && entry.mtime == task.source.mtime)
+    {
+        task.source.hash = entry.hash;
+        return;
+    }
+    // 数据已经在内存中, 比写入时重新读取文件便宜
+    task.source.hash = OutputManifest::HashData(task.file_data);
+}
+
+bool PhotoWaterMarkWork::IsUpToDate(ImageTask & task)
+{
+    const std::filesystem::path relative_path = GetRelativePath(task.input_file);
+    const std::string key = relative_path.generic_string();
+    ManifestEntry entry;
+    if (!manifest_.Find(key, entry) || entry.param_hash != param_hash_ || entry.size != task.source.size)
+        return false;
+    for (const auto & rendition : renditions_)
+    {
+        std::error_code ec;
+        if (!std::filesystem::exists(GetOutputPath(rendition, relative_path), ec))
+            return false;
+    }
+    if (entry.mtime == task.source.mtime)
+        return true;
+
+    // 只有修改时间变化时比较内容, 内容相同则更新清单中的时间
+    if (entry.hash != OutputManifest::HashFile(task.input_file))
+        return false;
+    entry.mtime = task.source.mtime;
+    manifest_.Update(key, entry);
+    return true;
+}
+
+QByteArray PhotoWaterMarkWork::HashParam(const WaterMarkParam & param)
+{
+    // 只包含影响输出内容的字段, 版本号在排版方式变化时递增, 递增后所有已有的清单都会失效
+    // 2: 文字改用 QTextLayout 排版, 自定义字符串不再是空行, 右下富文本使用自己的内容,
+    //    自动居中时 exif 中没有内容的一行不再占位
+    QByteArray text("photo_watermark/2\n");
+    // 没有指定输出时与 Init 一样使用一个默认输出, 界面与命令行的相同设置得到相同的哈希
+    const std::vector<Rendition> renditions = param.renditions.empty() ? std::vector<Rendition>(1) : param.renditions;
+    text += param.font.key().toUtf8() + '\n';
+    text += QByteArray::number(param.border_ratio, 'g', 17) + '\n';
+    text += QByteArray::number(param.add_frame) + QByteArray::number(param.auto_align) +
+        QByteArray::number(param.lossless) + '\n';
+    text += QByteArray::fromStdString(param.logo) + '\n';
+    for (const auto & rendition : renditions)
+        text += QByteArray::fromStdString(rendition.dir) + ':' + QByteArray::number(rendition.long_edge) + ':' +
+            QByteArray::number(rendition.quality) + ':' + QByteArray::fromStdString(rendition.format) + ':' +
+            QByteArray::number(static_cast<int>(rendition.subsampling)) + ':' + QByteArray::number(rendition.progressive) +
+            QByteArray::number(rendition.optimize_huffman) + QByteArray::number(rendition.fast_encode) + '\n';
+    for (const auto & [position, setting] : param.text_settings)
+    {
+        text += QByteArray::number(static_cast<int>(position)) + ':' +
+            QByteArray::number(static_cast<int>(setting.text_type)) + ':' +
+            QByteArray::number(setting.weight) + ':' + setting.custom_data.toUtf8() + '\n';
+    }
+    // 替换 logo 图片后需要重新生成; 各节点的修改时间不同, 使用文件内容
+    std::vector<std::filesystem::path> logos;
+    std::error_code ec;
+    for (const auto & file : std::filesystem::directory_iterator(GetSelfPath().parent_path() / "logos", ec))
+    {
+        if (file.is_regular_file(ec))
+            logos.push_back(file.path());
+    }
+    std::sort(logos.begin(), logos.end());
+    for (const auto & logo : logos)
+        text += QByteArray::fromStdString(logo.filename().string()) + ':' + OutputManifest::HashFile(logo) + '\n';
+    return OutputManifest::HashData(text);
+}
+
 bool PhotoWaterMarkWork::LoadLogos()
 {
     const std::filesystem::path logos_path(self_dir_ / "logos");
     if (logos_path.empty() || !std::filesystem::exists(logos_path))
     {
         qWarning() << "Logos path " << logos_path.string().c_str() << "not exists.";
+        logo_map_.clear();
+        logo_index_.Clear();
+        logos_state_.clear();
         return false;
     }
 
+    // 文件名、大小与修改时间都没有变化时保留已经解码的 logo, 工作节点每个分块都会 Init 一次
+    std::vector<std::filesystem::path> files;
     for (const auto & file : std::filesystem::directory_iterator{ logos_path })
+        files.push_back(file.path());
+    std::sort(files.begin(), files.end());
+    std::string state;
+    for (const auto & file : files)
+    {
+        std::error_code ec;
+        state += file.filename().string() + ':' + std::to_string(std::filesystem::file_size(file, ec)) + ':' +
+            std::to_string(std::filesystem::last_write_time(file, ec).time_since_epoch().count()) + '\n';
+    }
+    if (state == logos_state_)
+        return true;
+    logo_map_.clear();
+    logo_index_.Clear();
+
+    // 所有 logo 只解码一次, 缩放结果按目标高度缓存
+    for (const auto & file : files)
     {
-        auto file_name = file.path().stem();
-        logo_map_.emplace(file_name.string(), std::filesystem::absolute(file).string());
+        LogoImage logo;
+        logo.path = std::filesystem::absolute(file).string();
+        QImageReader image_reader(QString::fromLocal8Bit(logo.path.data(), static_cast<qsizetype>(logo.path.size())));
+        image_reader.setAutoTransform(true);
+        logo.image = image_reader.read();
+        if (logo.image.isNull())
+        {
+            qWarning() << "Load logo " << logo.path.c_str() << "failed.";
+            continue;
+        }
+        logo_map_.emplace(file.stem().string(), std::move(logo));
     }
+
+    std::vector<std::string> names;
+    names.reserve(logo_map_.size());
+    for (const auto & [name, logo] : logo_map_)
+        names.push_back(name);
+    logo_index_.Build(names);
+    logos_state_ = std::move(state);
     return true;
 }
 
-QString PhotoWaterMarkWork::genText(const TextType & choice, easyexif::EXIFInfo & exif) const
+const ScaledLogo & PhotoWaterMarkWork::GetScaledLogo(const LogoImage & logo, int height) const
 {
-    QString ss;
-    int num = static_cast<int>(1.0 / exif.ExposureTime);
-    switch (choice)
     {
-    case TextType::kModel:
-        ss = QString(exif.Model.c_str());
-        break;
-    case TextType::kLensModel:
-        ss = QString(exif.LensInfo.Model.c_str());
-        break;
-    case TextType::kExposureParam:
-        ss = QString::asprintf("%dmm ISO%d 1/%d f/%.1lf", exif.FocalLengthIn35mm,
-                               exif.ISOSpeedRatings, num, exif.FNumber);
-        break;
-    case TextType::kData:
-        ss = QString(exif.DateTime.c_str());
-        break;
-    case TextType::kGps:
-    {
-        const auto & longitude = exif.GeoLocation.LonComponents;
-        const auto & latitude = exif.GeoLocation.LatComponents;
-        ss = QString::asprintf("%d°%d'%d\"%c %d°%d'%d\"%c",
-                               static_cast<int>(latitude.degrees), static_cast<int>(latitude.minutes),
-                               static_cast<int>(latitude.seconds), latitude.direction,
-                               static_cast<int>(longitude.degrees), static_cast<int>(longitude.minutes),
-                               static_cast<int>(longitude.seconds), longitude.direction);
-        break;
-    }
-    default:
-        return param_.auto_align ? "" : "&nbsp;";
+        std::lock_guard lock(logo_mutex_);
+        auto found = logo.scaled.find(height);
+        if (found != logo.scaled.end())
+            return found->second;
     }
-    if (ss.isEmpty())
-    {
-        ss = param_.auto_align ? "" : "&nbsp;";
-    }
-    return ss;
+
+    // 与 scaledToHeight 相同的取整方式, 不需要真的缩放一次来获得宽度
+    ScaledLogo scaled;
+    const qreal factor = static_cast<qreal>(height) / logo.image.height();
+    scaled.box_width = qRound(factor * logo.image.width());
+    scaled.image = logo.image.scaled(scaled.box_width, height, Qt::KeepAspectRatio)
+                       .convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    std::lock_guard lock(logo_mutex_);
+    return logo.scaled.emplace(height, std::move(scaled)).first->second;
 }
 
-void PhotoWaterMarkWork::PaintLeft(QPainter * painter, easyexif::EXIFInfo & exif,
-                                   int draw_x, int watermark_height, int board_size)
+void PhotoWaterMarkWork::PaintLeft(QPainter * painter, const easyexif::EXIFInfo & exif,
+                                   int draw_x, int watermark_height, int board_size) const
 {
-    const auto & lt = param_.text_settings[TextPosition::kLeftTop];
-    const auto & lb = param_.text_settings[TextPosition::kLeftBottom];
-
-    if (lt.text_type == TextType::kNone && lb.text_type == TextType::kNone)
+    const TextBlock block = text_renderer_.Layout(TextPosition::kLeftTop, TextPosition::kLeftBottom, exif, board_size);
+    if (block.size.isEmpty())
         return;
+    block.Draw(painter, QPoint(draw_x, watermark_height / 2 - block.size.height() / 2));
+}
 
-    QString text;
-    // LT
-    if (lt.text_type != TextType::KRichText)
-        text.append(QString(
-            "<p style=';line-height:120%'><span style ='font-size:%1px; color:#323232; font-weight:%2'>%3</span>")\
-            .arg(static_cast<int>(board_size * 0.7)).arg(lt.weight).arg(genText(lt.text_type, exif)));
-    else
-        text.append(lt.custom_data);
-    // LB
-    if (lb.text_type != TextType::KRichText)
-        text.append(QString(
-            "<p style=';line-height:120%'><span style ='font-size:%1px; color:#505050;font-weight:%2'>%3</span>")\
-            .arg(static_cast<int>(board_size * 0.65)).arg(lb.weight).arg(genText(lb.text_type, exif)));
-    else
-        text.append(lb.custom_data);
+CacheStats PhotoWaterMarkWork::GetTextCacheStats() const
+{
+    return text_renderer_.GetCacheStats();
+}
 
-    QTextDocument td;
-    td.setDefaultFont(param_.font);
-    td.setDefaultTextOption(QTextOption(Qt::AlignVCenter | Qt::AlignLeft));
-    td.setHtml(text);
-    QPoint to_point(draw_x, watermark_height / 2 - td.size().toSize().height() / 2);
-    painter->translate(to_point);
-    td.drawContents(painter);
-    painter->translate(QPoint(0, 0) - to_point);
+CacheStats PhotoWaterMarkWork::GetBufferPoolStats(PoolKind kind) const
+{
+    return buffer_pool_.Stats(kind);
 }
 
-void PhotoWaterMarkWork::PaintRight(QPainter * painter, easyexif::EXIFInfo & exif,
-                                    int image_width, int watermark_height, int board_size)
+MetricsSnapshot PhotoWaterMarkWork::GetMetrics() const
 {
-    const auto & rt = param_.text_settings[TextPosition::kRightTop];
-    const auto & rb = param_.text_settings[TextPosition::kRightBottom];
+    return metrics_.Snapshot();
+}
 
-    int draw_x = image_width - (param_.add_frame ? 2 * board_size : board_size);
-    int text_height = 0;
-    if (rt.text_type != TextType::kNone ||
-        rb.text_type != TextType::kNone)
-    {
-        QString text;
-        // RT
-        if (rt.text_type != TextType::KRichText)
-            text.append(QString("<p style='line-height:120%'><span style ='font-size:%1px; color:#323232; font-weight:%2'>%3</span>")\
-                        .arg(static_cast<int>(board_size * 0.7)).arg(rt.weight).arg(genText(rt.text_type, exif)));
-        else
-            text.append(rt.custom_data);
-        // RB
-        if (rb.text_type != TextType::KRichText)
-            text.append(QString("<p style='line-height:120%'><span style ='font-size:%1px; color:#505050;font-weight:%2'>%3</span>")\
-                        .arg(static_cast<int>(board_size * 0.65)).arg(rb.weight).arg(genText(rb.text_type, exif)));
-        else
-            text.append(rt.custom_data);
+void PhotoWaterMarkWork::ClearTextCache()
+{
+    text_renderer_.ClearCache();
+}
 
-        QTextDocument td;
-        td.setDefaultFont(param_.font);
-        td.setDefaultTextOption(QTextOption(Qt::AlignVCenter | Qt::AlignLeft));
-        td.setHtml(text);
-        draw_x -= td.size().toSize().width();
-        text_height = td.size().toSize().height();
-        QPoint to_point(draw_x, watermark_height / 2 - text_height / 2);
-        painter->translate(to_point);
-        td.drawContents(painter);
-        painter->translate(QPoint(0, 0) - to_point);
+void PhotoWaterMarkWork::PaintRight(QPainter * painter, const easyexif::EXIFInfo & exif,
+                                    int image_width, int watermark_height, int board_size) const
+{
+    int draw_x = image_width - (param_.add_frame ? 2 * board_size : board_size);
+    const TextBlock block = text_renderer_.Layout(TextPosition::kRightTop, TextPosition::kRightBottom, exif, board_size);
+    const int text_height = block.size.height();
+    if (!block.size.isEmpty())
+    {
+        draw_x -= block.size.width();
+        block.Draw(painter, QPoint(draw_x, watermark_height / 2 - text_height / 2));
     }
 
     PaintLogo(painter, exif, text_height, draw_x, board_size);
 }
 
-void PhotoWaterMarkWork::PaintLogo(QPainter * painter, easyexif::EXIFInfo & exif,
-                                   int font_box_height, int font_box_left, int board_size)
+const LogoImage * PhotoWaterMarkWork::FindLogo(const easyexif::EXIFInfo & exif) const
 {
     std::string logo_choice = exif.Make;
     if (param_.logo != "Auto" && !param_.logo.empty())
         logo_choice = param_.logo;
     if (logo_choice.empty())
-        return;
+        return nullptr;
 
-    auto found = std::ranges::find_if(logo_map_,
-                                      [&exif, &logo_choice](const std::pair<std::string, std::string> & ele)-> bool
-                                      {
-                                          return 0 == strncasecmp(logo_choice.c_str(), ele.first.c_str(),
-                                                                  std::min(logo_choice.size(), ele.first.size()));
-                                      });
+    const std::string name = logo_index_.Resolve(logo_choice);
+    if (name.empty())
+        return nullptr;
+    auto found = logo_map_.find(name);
     if (found == logo_map_.end())
+        return nullptr;
+    return &found->second;
+}
+
+void PhotoWaterMarkWork::PaintLogo(QPainter * painter, const easyexif::EXIFInfo & exif,
+                                   int font_box_height, int font_box_left, int board_size) const
+{
+    const LogoImage * logo = FindLogo(exif);
+    if (nullptr == logo)
         return;
-    QImageReader image_reader(found->second.c_str());
-    image_reader.setAutoTransform(true);
-    QImage logo = image_reader.read();
 
     int img_h = font_box_height == 0 ? board_size * 2 : static_cast<int>(font_box_height * 0.9);
-    int img_w = logo.scaledToHeight(img_h).width();
+    if (img_h <= 0)
+        return;
+    const ScaledLogo & scaled = GetScaledLogo(*logo, img_h);
+    int img_w = scaled.box_width;
     int left_padding = font_box_left - 0.9 * board_size - img_w;
     int top_padding = 2 * board_size - img_h / 2;
-    painter->drawImage(left_padding, top_padding, logo.scaled(img_w, img_h, Qt::KeepAspectRatio));
+    painter->drawImage(left_padding, top_padding, scaled.image);
     // 如果右边没字就不画这根线
     if (font_box_height > 0)
     {
@@ -1,31 +1,64 @@
 ﻿#pragma once
 #include "utils.h"
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <QByteArray>
+#include <QFile>
 #include <QFont>
+#include <QImage>
+#include <QSize>
 #include <QString>
 
+#include "buffer_pool.h"
+#include "checkpoint.h"
 #include "exif.h"
+#include "jpeg_encoder.h"
+#include "logo_index.h"
+#include "lossless_jpeg.h"
+#include "memory_budget.h"
+#include "output_manifest.h"
+#include "pipeline_metrics.h"
+#include "render_cache.h"
+#include "text_renderer.h"
 
-using progress_callback = std::function<void(int cur, int failed, int total, bool done)>;
+// 输入目录边扫描边处理, total 为已经找到的图片数量, 扫描结束前会继续增长
+// metrics 为本次处理的统计, 可以在回调中读取
+using progress_callback = std::function<void(int cur, int failed, int total, bool done, const PipelineMetrics & metrics)>;
 
-using TextPosition = enum class TextPosition
+using ScaledLogo = struct ScaledLogo
 {
-    kLeftTop,
-    kRightTop,
-    kLeftBottom,
-    kRightBottom,
+    int box_width = 0; // 排版使用的宽度
+    QImage image; // 预乘 alpha, 可以直接绘制
 };
 
-using TextSetting = struct TextSetting
+using LogoImage = struct LogoImage
 {
-    TextType text_type = TextType::kNone;
-    QString custom_data;
-    int weight = 0;
+    std::string path;
+    QImage image;
+    mutable std::map<int, ScaledLogo> scaled; // <target height, image>, 由 logo_mutex_ 保护
+};
+
+// 一种输出, 所有输出共用一次解码与排版, 较小的从最大的一张缩放得到
+using Rendition = struct Rendition
+{
+    std::string dir; // sub directory of output_path, empty = output_path itself
+    int long_edge = 0; // long edge of the source part of the output, 0 = source size
+    int quality = 100; // encoder quality, 0-100
+    std::string format = "jpg"; // QImageWriter format (jpg, png, webp, avif... if the plugin exists), also the file extension
+    ChromaSubsampling subsampling = ChromaSubsampling::kDefault; // jpeg only, other values need libjpeg
+    bool progressive = false; // jpeg only
+    bool optimize_huffman = false; // jpeg only
+    bool fast_encode = false; // jpeg only, libjpeg encodes the canvas scanlines directly instead of QImageWriter
 };
 
 using WaterMarkParam = struct WaterMarkParam
@@ -38,6 +71,61 @@ using WaterMarkParam = struct WaterMarkParam
     bool auto_align = false;
     std::string logo;
     std::map<TextPosition, TextSetting> text_settings;
+    int thread_count = 0; // worker threads, 0 = std::thread::hardware_concurrency()
+    int queue_capacity = 2; // max images waiting between two pipeline stages
+    bool use_mmap = true; // map input files instead of reading them into memory
+    bool dry_run = false; // only read exif headers and resolve logos, write nothing
+    bool lossless = false; // keep source DCT blocks, border snaps to MCU multiples (needs libjpeg)
+    bool incremental = true; // skip images whose source and settings match the manifest in output_path
+    bool recursive = true; // scan sub directories, the tree is mirrored under output_path
+    int64_t memory_budget = 0; // bytes of estimated image memory in flight, 0 = unlimited; a larger image runs alone
+    std::vector<Rendition> renditions; // empty = one source size output in output_path
+    bool resume = false; // skip images listed in the checkpoint of a cancelled or interrupted run with the same settings
+    std::string metrics_path; // write the run metrics here when it ends, .csv = CSV, otherwise JSON; empty = don't write
+    std::vector<std::string> input_files; // paths relative to input_path; non-empty = process only these without scanning, the manifest and checkpoint are not used (distributed chunks)
+};
+
+// 输出图片的排版, 单位为像素
+using CanvasLayout = struct CanvasLayout
+{
+    int border_size = 0;
+    int width = 0;
+    int height = 0;
+    int source_x = 0; // 原图在画布中的位置
+    int source_y = 0;
+    int watermark_y = 0; // 水印区域的上边缘
+    int watermark_height = 0;
+    int text_x = 0; // 左侧文字的起点
+};
+
+// 一个输出的画布与编码结果
+using ImageOutput = struct ImageOutput
+{
+    size_t rendition = 0; // renditions_ 中的下标
+    QImage canvas;
+    bool scaled = false; // 由最大的一张缩放得到, 尺寸各不相同, 不放回缓冲池
+    QByteArray encoded;
+};
+
+// 流水线中单张图片的数据, 每个阶段处理完后释放不再需要的部分
+using ImageTask = struct ImageTask
+{
+    std::string input_file;
+    std::string error; // 失败原因, 记录到统计中
+    int64_t memory_cost = 0; // 在 memory_budget_ 中占用的估算字节数, 处理结束时归还
+    ManifestEntry source; // 写入成功后记录到清单
+    std::unique_ptr<QFile> mapped_file; // 映射成功时 file_data 直接引用映射内存
+    QByteArray file_data;
+    easyexif::EXIFInfo exif;
+    QImage source_img; // 按最大的输出尺寸解码
+    std::vector<ImageOutput> outputs;
+
+    // 无损模式: 不解码原图, 只编码边框与水印区域
+    bool lossless = false;
+    int source_width = 0;
+    int source_height = 0;
+    int mcu_size = 0;
+    LosslessLayout lossless_layout;
 };
 
 class PhotoWaterMarkWork
@@ -45,38 +133,183 @@ class PhotoWaterMarkWork
 public:
     PhotoWaterMarkWork();
 
+    // 取消正在进行的处理并等待线程结束
+    ~PhotoWaterMarkWork();
+
     bool Init(const WaterMarkParam & param, progress_callback cb);
 
     bool WorkStart();
 
+    // 预览只需要排版参数, 不检查输入输出目录, 与批量处理使用不同的实例
+    bool InitPreview(const WaterMarkParam & param);
+
+    // 按长边为 long_edge 缩小解码, 结果在调整设置时可以重复使用
+    bool DecodePreview(const std::string & image_path, int long_edge, QImage & source, easyexif::EXIFInfo & exif);
+
+    // 与批量处理相同的画布与水印绘制
+    bool ComposePreview(const easyexif::EXIFInfo & exif, const QImage & source, QImage & preview);
+
+    // 阻塞直到本次处理结束
+    void Wait();
+
+    // 停止读取新的图片并丢弃流水线中还未处理的图片, 已经写入的图片保留在检查点中
+    void Cancel();
+
+    // 本次处理是否被取消
+    bool IsCancelled() const;
+
+    // 各阶段处理完手中的图片后等待, Resume 后继续
+    void Pause();
+
+    void Resume();
+
+    bool IsPaused() const;
+
     void Clean();
 
+    // 加载程序目录下 font 文件夹内的字体
+    static void LoadBundledFonts();
+
+    // 水印文字渲染缓存的命中统计
+    CacheStats GetTextCacheStats() const;
+
+    void ClearTextCache();
+
+    // 图片缓冲池的命中统计
+    CacheStats GetBufferPoolStats(PoolKind kind) const;
+
+    // 最近一次处理的统计, 处理中也可以调用
+    MetricsSnapshot GetMetrics() const;
+
+    // 按 Init 的参数扫描输入目录, 路径相对 input_path, 分布式处理时由协调者分块
+    std::vector<std::string> ListInputs() const;
+
+    // 影响输出内容的参数与 logo 文件内容的哈希, 同一批处理的所有节点必须相同
+    static QByteArray HashParam(const WaterMarkParam & param);
+
 protected:
     void Work();
 
+    // 暂停时阻塞, 已取消时返回 false
+    bool WaitIfPaused();
+
+    int GetWorkerCount() const;
+
+    // 遍历输入目录, 每找到一张 jpeg 调用一次 emit, emit 返回 false 时停止
+    void DiscoverInputs(const std::function<bool(std::string)> & emit) const;
+
+    // 单线程依次执行全部阶段
     bool ImageProcessing(const std::string & image_path);
 
+    // 流水线各阶段: read -> decode -> compose -> encode -> write
+    bool ReadStage(ImageTask & task) const;
+
+    bool MapInput(ImageTask & task) const;
+
+    // 由文件头中的尺寸估算处理这张图片时内存占用的峰值, 没有设置预算时返回 0
+    int64_t EstimateMemory(const ImageTask & task) const;
+
+    // 估算并等待内存预算, 预算关闭时返回 false
+    bool AcquireMemory(ImageTask & task);
+
+    bool ScanStage(ImageTask & task) const;
+
+    void ReleaseInput(ImageTask & task) const;
+
+    bool DecodeStage(ImageTask & task) const;
+
+    // 解码 file_data 中的原图, 完成后释放输入
+    bool DecodeImage(ImageTask & task) const;
+
+    bool PrepareLossless(ImageTask & task) const;
+
+    int GetBorderSize(int width, int height) const;
+
+    // 等比缩放到长边为 long_edge
+    static QSize ScaleToLongEdge(const QSize & size, int long_edge);
+
+    CanvasLayout GetCanvasLayout(int width, int height) const;
+
+    // 创建白色的 RGB32 画布并逐行复制原图
+    bool CreateCanvas(QImage & canvas, const QImage & source, const CanvasLayout & layout) const;
+
+    bool ComposeStage(ImageTask & task);
+
+    // 按 source 的尺寸排版并绘制水印, 得到最大的一张输出
+    bool ComposeOutput(const easyexif::EXIFInfo & exif, const QImage & source, QImage & canvas);
+
+    bool ComposeLosslessStage(ImageTask & task);
+
+    bool EncodeStage(ImageTask & task) const;
+
+    bool EncodeOutput(ImageOutput & output) const;
+
+    // 指定了色度采样或快速编码时使用 libjpeg, 否则使用 QImageWriter
+    static bool UseLibjpeg(const Rendition & rendition);
+
+    bool WriteStage(ImageTask & task);
+
+    // 输出文件相对 output_path 的路径, 也是清单中的键
+    std::filesystem::path GetRelativePath(const std::string & input_file) const;
+
+    // 格式不是 jpeg 时扩展名随格式改变
+    std::filesystem::path GetOutputPath(const Rendition & rendition, const std::filesystem::path & relative_path) const;
+
+    static bool IsJpegFormat(const std::string & format);
+
+    bool StatSource(ImageTask & task) const;
+
+    // 写入清单需要的源文件哈希, 清单中已有相同大小与修改时间的记录时沿用, 不使用清单时不计算
+    void HashSource(ImageTask & task) const;
+
+    // 清单中有相同的源文件与参数, 且输出文件仍然存在
+    bool IsUpToDate(ImageTask & task);
+
     bool LoadLogos();
 
-    QString genText(const TextType & choice, easyexif::EXIFInfo & exif) const;
+    // 绘制只读取处理开始前确定的设置, 可以在多个工作线程中同时调用
+    void PaintLeft(QPainter * painter, const easyexif::EXIFInfo & exif,
+                   int draw_x, int watermark_height, int board_size) const;
+
+    void PaintRight(QPainter * painter, const easyexif::EXIFInfo & exif,
+                    int image_width, int watermark_height, int board_size) const;
 
-    void PaintLeft(QPainter * painter, easyexif::EXIFInfo & exif,
-                   int draw_x, int watermark_height, int board_size);
+    const LogoImage * FindLogo(const easyexif::EXIFInfo & exif) const;
 
-    void PaintRight(QPainter * painter, easyexif::EXIFInfo & exif,
-                    int image_width, int watermark_height, int board_size);
+    const ScaledLogo & GetScaledLogo(const LogoImage & logo, int height) const;
 
-    void PaintLogo(QPainter * painter, easyexif::EXIFInfo & exif,
-                   int font_box_height, int font_box_left, int board_size);
+    void PaintLogo(QPainter * painter, const easyexif::EXIFInfo & exif,
+                   int font_box_height, int font_box_left, int board_size) const;
 
 private:
     progress_callback cb_ = nullptr;
     WaterMarkParam param_ = { };
     std::filesystem::path self_dir_;
 
-    std::vector<std::string> input_files_;
-    std::map<std::string, std::string> logo_map_; // <make, file_path>
+    std::filesystem::path input_root_; // 绝对路径
+    std::filesystem::path output_root_;
+    std::vector<Rendition> renditions_; // 至少有一个
+    int decode_long_edge_ = 0; // 所有输出中最大的长边, 0 = 原图尺寸
+    std::unordered_map<std::string, LogoImage> logo_map_; // <make, logo>
+    LogoIndex logo_index_;
+    std::string logos_state_; // 加载时 logo 目录中的文件名、大小与修改时间
+    mutable std::mutex logo_mutex_;
+
+    PipelineMetrics metrics_;
+    TextRenderer text_renderer_{ &metrics_ };
+    mutable BufferPool buffer_pool_;
+
+    OutputManifest manifest_;
+    std::chrono::steady_clock::time_point manifest_saved_; // 只在写入线程中使用
+    QByteArray param_hash_;
+    MemoryBudget memory_budget_;
+
+    Checkpoint checkpoint_;
 
     std::atomic_bool working_ = { false };
+    std::atomic_bool cancelled_ = { false };
+    mutable std::mutex pause_mutex_;
+    std::condition_variable pause_cv_;
+    bool paused_ = false;
     std::thread thread_;
 };
@@ -0,0 +1,250 @@
+﻿#include "pipeline_metrics.h"
+
+#include <algorithm>
+#include <cctype>
+#include <QDebug>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+namespace
+{
+constexpr int kMetricsVersion = 1;
+constexpr size_t kStageCount = static_cast<size_t>(MetricStage::kCount);
+
+QByteArray CsvField(const std::string & text)
+{
+    // 含有逗号、引号或换行时加引号, 引号写两次
+    QByteArray field = QByteArray::fromStdString(text);
+    if (field.contains(',') || field.contains('"') || field.contains('\n'))
+        field = '"' + field.replace("\"", "\"\"") + '"';
+    return field;
+}
+
+QByteArray Number(double value)
+{
+    return QByteArray::number(value, 'f', 3);
+}
+}
+
+void LatencyHistogram::Add(double ms)
+{
+    const auto bound = std::lower_bound(kBounds.begin(), kBounds.end(), ms);
+    ++buckets[static_cast<size_t>(bound - kBounds.begin())];
+    ++count;
+    total_ms += ms;
+    max_ms = std::max(max_ms, ms);
+}
+
+double LatencyHistogram::Percentile(double p) const
+{
+    if (0 == count)
+        return 0;
+    const double target = std::clamp(p, 0.0, 1.0) * static_cast<double>(count);
+    double seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i)
+    {
+        if (0 == buckets[i] || seen + static_cast<double>(buckets[i]) < target)
+        {
+            seen += static_cast<double>(buckets[i]);
+            continue;
+        }
+        const double lower = i == 0 ? 0 : kBounds[i - 1];
+        const double upper = i < kBounds.size() ? std::min(kBounds[i], max_ms) : max_ms;
+        const double ratio = (target - seen) / static_cast<double>(buckets[i]);
+        return lower + (std::max(upper, lower) - lower) * ratio;
+    }
+    return max_ms;
+}
+
+void PipelineMetrics::Reset()
+{
+    std::lock_guard lock(mutex_);
+    start_ = Clock::now();
+    data_ = MetricsSnapshot();
+}
+
+void PipelineMetrics::AddLatency(MetricStage stage, double ms)
+{
+    std::lock_guard lock(mutex_);
+    data_.stages[static_cast<size_t>(stage)].Add(ms);
+}
+
+void PipelineMetrics::AddBytesRead(int64_t bytes)
+{
+    std::lock_guard lock(mutex_);
+    data_.bytes_read += bytes;
+}
+
+void PipelineMetrics::AddBytesWritten(int64_t bytes)
+{
+    std::lock_guard lock(mutex_);
+    data_.bytes_written += bytes;
+}
+
+void PipelineMetrics::AddImage(bool ok)
+{
+    std::lock_guard lock(mutex_);
+    if (ok)
+        ++data_.images_done;
+    else
+        ++data_.images_failed;
+}
+
+void PipelineMetrics::AddSkipped()
+{
+    std::lock_guard lock(mutex_);
+    ++data_.images_skipped;
+}
+
+void PipelineMetrics::AddFailure(const std::string & input_file, MetricStage stage, const std::string & reason)
+{
+    std::lock_guard lock(mutex_);
+    data_.failures.push_back({ input_file, StageName(stage), reason.empty() ? "unknown" : reason });
+}
+
+MetricsSnapshot PipelineMetrics::Snapshot() const
+{
+    std::lock_guard lock(mutex_);
+    MetricsSnapshot snapshot = data_;
+    snapshot.elapsed_seconds = ElapsedSeconds();
+    if (snapshot.elapsed_seconds > 0)
+        snapshot.images_per_second = (snapshot.images_done + snapshot.images_failed) / snapshot.elapsed_seconds;
+    return snapshot;
+}
+
+double PipelineMetrics::ImagesPerSecond() const
+{
+    std::lock_guard lock(mutex_);
+    const double elapsed = ElapsedSeconds();
+    return elapsed > 0 ? (data_.images_done + data_.images_failed) / elapsed : 0;
+}
+
+double PipelineMetrics::ElapsedSeconds() const
+{
+    return std::chrono::duration<double>(Clock::now() - start_).count();
+}
+
+const char * PipelineMetrics::StageName(MetricStage stage)
+{
+    switch (stage)
+    {
+    case MetricStage::kRead:
+        return "read";
+    case MetricStage::kDecode:
+        return "decode";
+    case MetricStage::kCompose:
+        return "compose";
+    case MetricStage::kText:
+        return "text";
+    case MetricStage::kEncode:
+        return "encode";
+    case MetricStage::kWrite:
+        return "write";
+    default:
+        return "";
+    }
+}
+
+QByteArray PipelineMetrics::ToJson(const MetricsSnapshot & snapshot)
+{
+    QJsonObject stages;
+    for (size_t i = 0; i < kStageCount; ++i)
+    {
+        const auto & histogram = snapshot.stages[i];
+        QJsonArray buckets;
+        for (size_t b = 0; b < histogram.buckets.size(); ++b)
+        {
+            QJsonObject bucket;
+            // 最后一个桶的上界为 null
+            bucket.insert("le_ms", b < LatencyHistogram::kBounds.size() ? QJsonValue(LatencyHistogram::kBounds[b])
+                                                                         : QJsonValue());
+            bucket.insert("count", static_cast<qint64>(histogram.buckets[b]));
+            buckets.append(bucket);
+        }
+        QJsonObject stage;
+        stage.insert("count", static_cast<qint64>(histogram.count));
+        stage.insert("total_ms", histogram.total_ms);
+        stage.insert("mean_ms", histogram.count > 0 ? histogram.total_ms / static_cast<double>(histogram.count) : 0);
+        stage.insert("p50_ms", histogram.Percentile(0.5));
+        stage.insert("p90_ms", histogram.Percentile(0.9));
+        stage.insert("p99_ms", histogram.Percentile(0.99));
+        stage.insert("max_ms", histogram.max_ms);
+        stage.insert("buckets", buckets);
+        stages.insert(StageName(static_cast<MetricStage>(i)), stage);
+    }
+
+    QJsonArray failures;
+    for (const auto & failure : snapshot.failures)
+    {
+        QJsonObject item;
+        item.insert("file", QString::fromStdString(failure.input_file));
+        item.insert("stage", QString::fromStdString(failure.stage));
+        item.insert("reason", QString::fromStdString(failure.reason));
+        failures.append(item);
+    }
+
+    QJsonObject root;
+    root.insert("version", kMetricsVersion);
+    root.insert("elapsed_seconds", snapshot.elapsed_seconds);
+    root.insert("images_done", snapshot.images_done);
+    root.insert("images_failed", snapshot.images_failed);
+    root.insert("images_skipped", snapshot.images_skipped);
+    root.insert("images_per_second", snapshot.images_per_second);
+    root.insert("bytes_read", static_cast<qint64>(snapshot.bytes_read));
+    root.insert("bytes_written", static_cast<qint64>(snapshot.bytes_written));
+    root.insert("stages", stages);
+    root.insert("failures", failures);
+    return QJsonDocument(root).toJson(QJsonDocument::Indented);
+}
+
+QByteArray PipelineMetrics::ToCsv(const MetricsSnapshot & snapshot)
+{
+    QByteArray csv = "stage,count,total_ms,mean_ms,p50_ms,p90_ms,p99_ms,max_ms";
+    for (const double bound : LatencyHistogram::kBounds)
+        csv += ",le_" + QByteArray::number(bound) + "ms";
+    csv += ",gt_" + QByteArray::number(LatencyHistogram::kBounds.back()) + "ms\n";
+    for (size_t i = 0; i < kStageCount; ++i)
+    {
+        const auto & histogram = snapshot.stages[i];
+        csv += QByteArray(StageName(static_cast<MetricStage>(i))) + ',' + QByteArray::number(histogram.count) + ',' +
+            Number(histogram.total_ms) + ',' +
+            Number(histogram.count > 0 ? histogram.total_ms / static_cast<double>(histogram.count) : 0) + ',' +
+            Number(histogram.Percentile(0.5)) + ',' + Number(histogram.Percentile(0.9)) + ',' +
+            Number(histogram.Percentile(0.99)) + ',' + Number(histogram.max_ms);
+        for (const uint64_t bucket : histogram.buckets)
+            csv += ',' + QByteArray::number(bucket);
+        csv += '\n';
+    }
+
+    csv += "\nmetric,value\n";
+    csv += "elapsed_seconds," + Number(snapshot.elapsed_seconds) + '\n';
+    csv += "images_done," + QByteArray::number(snapshot.images_done) + '\n';
+    csv += "images_failed," + QByteArray::number(snapshot.images_failed) + '\n';
+    csv += "images_skipped," + QByteArray::number(snapshot.images_skipped) + '\n';
+    csv += "images_per_second," + Number(snapshot.images_per_second) + '\n';
+    csv += "bytes_read," + QByteArray::number(snapshot.bytes_read) + '\n';
+    csv += "bytes_written," + QByteArray::number(snapshot.bytes_written) + '\n';
+
+    csv += "\nfile,stage,reason\n";
+    for (const auto & failure : snapshot.failures)
+        csv += CsvField(failure.input_file) + ',' + CsvField(failure.stage) + ',' + CsvField(failure.reason) + '\n';
+    return csv;
+}
+
+bool PipelineMetrics::Export(const MetricsSnapshot & snapshot, const std::filesystem::path & path)
+{
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    const QByteArray data = ext == ".csv" ? ToCsv(snapshot) : ToJson(snapshot);
+
+    const std::string file_name = path.string();
+    QSaveFile file(QString::fromLocal8Bit(file_name.data(), static_cast<qsizetype>(file_name.size())));
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size() || !file.commit())
+    {
+        qWarning() << "Write metrics" << file.fileName() << "failed.";
+        return false;
+    }
+    return true;
+}
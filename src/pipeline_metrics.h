@@ -0,0 +1,100 @@
+﻿#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <QByteArray>
+
+using MetricStage = enum class MetricStage
+{
+    kRead,
+    kDecode,
+    kCompose,
+    kText, // 文字排版与渲染, 包含在 compose 中, 只统计缓存未命中的
+    kEncode,
+    kWrite,
+    kCount,
+};
+
+// 延迟直方图, 桶的上界按 1-2-5 递增, 单位毫秒
+using LatencyHistogram = struct LatencyHistogram
+{
+    static constexpr std::array<double, 14> kBounds = { 1, 2, 5, 10, 20, 50, 100, 200, 500,
+                                                       1000, 2000, 5000, 10000, 20000 };
+
+    std::array<uint64_t, kBounds.size() + 1> buckets = { }; // 最后一个桶没有上界
+    uint64_t count = 0;
+    double total_ms = 0;
+    double max_ms = 0;
+
+    void Add(double ms);
+
+    // 在桶内线性插值估算, p 为 0-1
+    double Percentile(double p) const;
+};
+
+using FailureRecord = struct FailureRecord
+{
+    std::string input_file;
+    std::string stage;
+    std::string reason;
+};
+
+using MetricsSnapshot = struct MetricsSnapshot
+{
+    std::array<LatencyHistogram, static_cast<size_t>(MetricStage::kCount)> stages;
+    int64_t bytes_read = 0;
+    int64_t bytes_written = 0;
+    int images_done = 0; // 成功写入
+    int images_failed = 0;
+    int images_skipped = 0; // 增量模式或检查点中已经完成的
+    double elapsed_seconds = 0;
+    double images_per_second = 0; // 只计算实际处理的图片
+    std::vector<FailureRecord> failures;
+};
+
+// 一次处理的统计, 各阶段的线程可以同时写入
+class PipelineMetrics
+{
+public:
+    void Reset();
+
+    void AddLatency(MetricStage stage, double ms);
+
+    void AddBytesRead(int64_t bytes);
+
+    void AddBytesWritten(int64_t bytes);
+
+    void AddImage(bool ok);
+
+    void AddSkipped();
+
+    void AddFailure(const std::string & input_file, MetricStage stage, const std::string & reason);
+
+    // failures 较多时复制开销较大, 不要在每张图片的回调中调用
+    MetricsSnapshot Snapshot() const;
+
+    double ImagesPerSecond() const;
+
+    static const char * StageName(MetricStage stage);
+
+    static QByteArray ToJson(const MetricsSnapshot & snapshot);
+
+    // 依次为阶段耗时、汇总、失败列表三张表, 之间用空行分隔
+    static QByteArray ToCsv(const MetricsSnapshot & snapshot);
+
+    // 扩展名为 .csv 时写入 csv, 否则写入 json
+    static bool Export(const MetricsSnapshot & snapshot, const std::filesystem::path & path);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    double ElapsedSeconds() const;
+
+    mutable std::mutex mutex_;
+    Clock::time_point start_ = Clock::now();
+    MetricsSnapshot data_;
+};
@@ -0,0 +1,316 @@
+﻿#include "pixel_kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PW_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define PW_TARGET_SSE2
+#define PW_TARGET_SSSE3
+#define PW_TARGET_AVX2
+#else
+// 32 位编译默认没有 -msse2, SSE2 的函数也需要单独开启
+#define PW_TARGET_SSE2 __attribute__((target("sse2")))
+#define PW_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define PW_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace
+{
+constexpr uint32_t kAlpha = 0xFF000000u;
+
+void FillScalar(uint32_t * dst, size_t count, uint32_t color)
+{
+    std::fill_n(dst, count, color);
+}
+
+void CopyScalar(uint32_t * dst, const uint32_t * src, size_t count)
+{
+    if (count > 0)
+        memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+void Rgb888Scalar(uint32_t * dst, const uint8_t * src, size_t count)
+{
+    for (size_t i = 0; i < count; ++i, src += 3)
+        dst[i] = kAlpha | (static_cast<uint32_t>(src[0]) << 16) | (static_cast<uint32_t>(src[1]) << 8) | src[2];
+}
+
+void Gray8Scalar(uint32_t * dst, const uint8_t * src, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = kAlpha | (static_cast<uint32_t>(src[i]) * 0x010101u);
+}
+
+#ifdef PW_SIMD_X86
+bool has_ssse3 = false;
+
+PW_TARGET_SSE2 void FillSse2(uint32_t * dst, size_t count, uint32_t color)
+{
+    const __m128i v = _mm_set1_epi32(static_cast<int>(color));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 4), v);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 8), v);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 12), v);
+    }
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+    FillScalar(dst + i, count - i, color);
+}
+
+PW_TARGET_SSE2 void CopySse2(uint32_t * dst, const uint32_t * src, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 4));
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 8));
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 12));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), a);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 4), b);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 8), c);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 12), d);
+    }
+    CopyScalar(dst + i, src + i, count - i);
+}
+
+PW_TARGET_SSE2 void Gray8Sse2(uint32_t * dst, const uint8_t * src, size_t count)
+{
+    // g -> gg -> gggg, 再补上 alpha
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(kAlpha));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        const __m128i lo = _mm_unpacklo_epi8(g, g);
+        const __m128i hi = _mm_unpackhi_epi8(g, g);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 4), _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 8), _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 12), _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
+    }
+    Gray8Scalar(dst + i, src + i, count - i);
+}
+
+// 每 4 个像素: 12 字节 RGB -> 16 字节 BGRA
+PW_TARGET_SSSE3 void Rgb888Ssse3(uint32_t * dst, const uint8_t * src, size_t count)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(kAlpha));
+    size_t i = 0;
+    // 每次读取 16 字节只用 12 字节, 末尾留出余量避免越界
+    for (; i + 6 <= count; i += 4)
+    {
+        const __m128i rgb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(_mm_shuffle_epi8(rgb, mask), alpha));
+    }
+    Rgb888Scalar(dst + i, src + i * 3, count - i);
+}
+
+PW_TARGET_AVX2 void FillAvx2(uint32_t * dst, size_t count, uint32_t color)
+{
+    const __m256i v = _mm256_set1_epi32(static_cast<int>(color));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 8), v);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 16), v);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 24), v);
+    }
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v);
+    FillScalar(dst + i, count - i, color);
+}
+
+PW_TARGET_AVX2 void CopyAvx2(uint32_t * dst, const uint32_t * src, size_t count)
+{
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 8));
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 16));
+        const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 24));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), a);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 8), b);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 16), c);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 24), d);
+    }
+    CopyScalar(dst + i, src + i, count - i);
+}
+
+PW_TARGET_AVX2 void Gray8Avx2(uint32_t * dst, const uint8_t * src, size_t count)
+{
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(kAlpha));
+    const __m256i spread = _mm256_set1_epi32(0x010101);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        const __m256i lo = _mm256_cvtepu8_epi32(g);
+        const __m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(g, 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_or_si256(_mm256_mullo_epi32(lo, spread), alpha));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 8), _mm256_or_si256(_mm256_mullo_epi32(hi, spread), alpha));
+    }
+    Gray8Scalar(dst + i, src + i, count - i);
+}
+
+// 两个 128 位通道各处理 4 个像素
+PW_TARGET_AVX2 void Rgb888Avx2(uint32_t * dst, const uint8_t * src, size_t count)
+{
+    const __m256i mask = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                          2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(kAlpha));
+    size_t i = 0;
+    for (; i + 10 <= count; i += 8)
+    {
+        const uint8_t * p = src + i * 3;
+        const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 12));
+        const __m256i rgb = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_or_si256(_mm256_shuffle_epi8(rgb, mask), alpha));
+    }
+    Rgb888Scalar(dst + i, src + i * 3, count - i);
+}
+#endif
+
+SimdLevel Detect()
+{
+#ifdef PW_SIMD_X86
+    bool sse2 = false;
+    bool avx2 = false;
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4] = { 0 };
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+    __cpuid(info, 1);
+    sse2 = (info[3] & (1 << 26)) != 0;
+    has_ssse3 = (info[2] & (1 << 9)) != 0;
+    // AVX2 还需要操作系统保存 ymm 寄存器
+    const bool os_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+    if (max_leaf >= 7 && os_avx)
+    {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2");
+    has_ssse3 = __builtin_cpu_supports("ssse3");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+    if (avx2)
+        return SimdLevel::kAvx2;
+    if (sse2)
+        return SimdLevel::kSse2;
+#endif
+    return SimdLevel::kScalar;
+}
+
+const SimdLevel detected_level = Detect();
+std::atomic<SimdLevel> active_level = detected_level;
+}
+
+SimdLevel DetectSimdLevel()
+{
+    return detected_level;
+}
+
+SimdLevel GetSimdLevel()
+{
+    return active_level.load(std::memory_order_relaxed);
+}
+
+void SetSimdLevel(SimdLevel level)
+{
+    active_level = std::min(level, detected_level);
+}
+
+const char * SimdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::kSse2:
+        return "sse2";
+    case SimdLevel::kAvx2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+void FillRgb32(uint32_t * dst, size_t count, uint32_t color)
+{
+#ifdef PW_SIMD_X86
+    switch (GetSimdLevel())
+    {
+    case SimdLevel::kAvx2:
+        return FillAvx2(dst, count, color);
+    case SimdLevel::kSse2:
+        return FillSse2(dst, count, color);
+    default:
+        break;
+    }
+#endif
+    FillScalar(dst, count, color);
+}
+
+void CopyRgb32(uint32_t * dst, const uint32_t * src, size_t count)
+{
+#ifdef PW_SIMD_X86
+    switch (GetSimdLevel())
+    {
+    case SimdLevel::kAvx2:
+        return CopyAvx2(dst, src, count);
+    case SimdLevel::kSse2:
+        return CopySse2(dst, src, count);
+    default:
+        break;
+    }
+#endif
+    CopyScalar(dst, src, count);
+}
+
+void Rgb888ToRgb32(uint32_t * dst, const uint8_t * src, size_t count)
+{
+#ifdef PW_SIMD_X86
+    switch (GetSimdLevel())
+    {
+    case SimdLevel::kAvx2:
+        return Rgb888Avx2(dst, src, count);
+    case SimdLevel::kSse2:
+        if (has_ssse3)
+            return Rgb888Ssse3(dst, src, count);
+        break;
+    default:
+        break;
+    }
+#endif
+    Rgb888Scalar(dst, src, count);
+}
+
+void Gray8ToRgb32(uint32_t * dst, const uint8_t * src, size_t count)
+{
+#ifdef PW_SIMD_X86
+    switch (GetSimdLevel())
+    {
+    case SimdLevel::kAvx2:
+        return Gray8Avx2(dst, src, count);
+    case SimdLevel::kSse2:
+        return Gray8Sse2(dst, src, count);
+    default:
+        break;
+    }
+#endif
+    Gray8Scalar(dst, src, count);
+}
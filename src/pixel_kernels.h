@@ -0,0 +1,32 @@
+﻿#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// 画布合成使用的像素操作, 运行时按 CPU 选择 AVX2 / SSE2 / 标量实现
+// 目标格式均为 QImage::Format_RGB32, 即本机字节序的 0xFFRRGGBB
+using SimdLevel = enum class SimdLevel
+{
+    kScalar,
+    kSse2, // SSE2, RGB888 转换额外需要 SSSE3, 不支持时使用标量实现
+    kAvx2,
+};
+
+// CPU 支持的最高级别
+SimdLevel DetectSimdLevel();
+
+SimdLevel GetSimdLevel();
+
+// 性能测试用, 不能高于 CPU 支持的级别
+void SetSimdLevel(SimdLevel level);
+
+const char * SimdLevelName(SimdLevel level);
+
+void FillRgb32(uint32_t * dst, size_t count, uint32_t color);
+
+void CopyRgb32(uint32_t * dst, const uint32_t * src, size_t count);
+
+// Format_RGB888 (R, G, B 字节顺序) -> RGB32
+void Rgb888ToRgb32(uint32_t * dst, const uint8_t * src, size_t count);
+
+// Format_Grayscale8 -> RGB32
+void Gray8ToRgb32(uint32_t * dst, const uint8_t * src, size_t count);
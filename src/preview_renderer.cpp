@@ -0,0 +1,102 @@
+﻿#include "preview_renderer.h"
+
+#include <QDebug>
+
+PreviewRenderer::PreviewRenderer(Callback cb)
+    : cb_(std::move(cb))
+{
+    thread_ = std::thread(&PreviewRenderer::Run, this);
+}
+
+PreviewRenderer::~PreviewRenderer()
+{
+    Stop();
+}
+
+uint64_t PreviewRenderer::Request(const WaterMarkParam & param, const std::string & image_path, int long_edge)
+{
+    uint64_t generation = 0;
+    {
+        std::lock_guard lock(mutex_);
+        generation = ++generation_;
+        pending_.param = param;
+        pending_.image_path = image_path;
+        pending_.long_edge = long_edge;
+        pending_.generation = generation;
+        has_pending_ = true;
+    }
+    cv_.notify_one();
+    return generation;
+}
+
+uint64_t PreviewRenderer::Generation() const
+{
+    return generation_;
+}
+
+void PreviewRenderer::Stop()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void PreviewRenderer::Run()
+{
+    while (true)
+    {
+        PreviewRequest request;
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this] { return has_pending_ || stop_; });
+            if (stop_)
+                return;
+            request = std::move(pending_);
+            has_pending_ = false;
+        }
+
+        // 每个耗时的步骤之前检查是否已经有更新的请求
+        QImage preview;
+        if (!work_.InitPreview(request.param) || !GetSource(request))
+        {
+            if (!IsStale(request.generation))
+                cb_(request.generation, QImage());
+            continue;
+        }
+        if (IsStale(request.generation))
+            continue;
+
+        const bool ok = work_.ComposePreview(exif_, source_, preview);
+        if (IsStale(request.generation))
+            continue;
+        cb_(request.generation, ok ? preview : QImage());
+    }
+}
+
+bool PreviewRenderer::IsStale(uint64_t generation) const
+{
+    return generation != generation_;
+}
+
+bool PreviewRenderer::GetSource(const PreviewRequest & request)
+{
+    if (!source_.isNull() && source_path_ == request.image_path && source_long_edge_ == request.long_edge)
+        return true;
+
+    source_ = QImage();
+    source_path_.clear();
+    if (IsStale(request.generation))
+        return false;
+    if (!work_.DecodePreview(request.image_path, request.long_edge, source_, exif_))
+    {
+        qWarning() << "Decode preview" << request.image_path.c_str() << "failed.";
+        return false;
+    }
+    source_path_ = request.image_path;
+    source_long_edge_ = request.long_edge;
+    return true;
+}
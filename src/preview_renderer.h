@@ -0,0 +1,65 @@
+﻿#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <QImage>
+
+#include "exif.h"
+#include "photo_watermark.h"
+
+// 在后台线程渲染单张预览, 使用与批量处理相同的排版与绘制
+// 新的请求会取代还未开始的请求, 正在渲染的旧请求在下一个阶段之间放弃
+class PreviewRenderer
+{
+public:
+    // preview 为空表示渲染失败, 只会收到最新一次请求的结果
+    using Callback = std::function<void(uint64_t generation, const QImage & preview)>;
+
+    explicit PreviewRenderer(Callback cb);
+
+    ~PreviewRenderer();
+
+    // 返回本次请求的序号, long_edge 为预览中原图部分的长边
+    uint64_t Request(const WaterMarkParam & param, const std::string & image_path, int long_edge);
+
+    // 最新一次请求的序号, 回调中用于丢弃已经过时的结果
+    uint64_t Generation() const;
+
+    void Stop();
+
+private:
+    using PreviewRequest = struct PreviewRequest
+    {
+        WaterMarkParam param;
+        std::string image_path;
+        int long_edge = 0;
+        uint64_t generation = 0;
+    };
+
+    void Run();
+
+    bool IsStale(uint64_t generation) const;
+
+    // 同一张图片与尺寸只解码一次, 调整设置时只重新合成
+    bool GetSource(const PreviewRequest & request);
+
+    Callback cb_;
+    PhotoWaterMarkWork work_;
+
+    std::string source_path_;
+    int source_long_edge_ = 0;
+    QImage source_;
+    easyexif::EXIFInfo exif_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    PreviewRequest pending_;
+    bool has_pending_ = false;
+    bool stop_ = false;
+    std::atomic_uint64_t generation_ = 0;
+    std::thread thread_;
+};
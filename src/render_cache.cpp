@@ -0,0 +1,50 @@
+﻿#include "render_cache.h"
+
+TextRenderCache::TextRenderCache(size_t capacity) : capacity_(capacity > 0 ? capacity : 1)
+{
+}
+
+TextRenderCache::Entry TextRenderCache::Get(const QString & key, const std::function<RenderedText()> & render)
+{
+    {
+        std::lock_guard lock(mutex_);
+        auto found = index_.find(key);
+        if (found != index_.end())
+        {
+            items_.splice(items_.begin(), items_, found.value());
+            ++hits_;
+            return items_.front().second;
+        }
+    }
+
+    ++misses_;
+    auto entry = std::make_shared<const RenderedText>(render());
+
+    std::lock_guard lock(mutex_);
+    // 其他线程可能已经渲染了同样的内容
+    auto found = index_.find(key);
+    if (found != index_.end())
+        return found.value()->second;
+    items_.emplace_front(key, entry);
+    index_.insert(key, items_.begin());
+    while (items_.size() > capacity_)
+    {
+        index_.remove(items_.back().first);
+        items_.pop_back();
+    }
+    return entry;
+}
+
+void TextRenderCache::Clear()
+{
+    std::lock_guard lock(mutex_);
+    items_.clear();
+    index_.clear();
+    hits_ = 0;
+    misses_ = 0;
+}
+
+CacheStats TextRenderCache::Stats() const
+{
+    return { hits_.load(), misses_.load() };
+}
@@ -0,0 +1,50 @@
+﻿#pragma once
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <QHash>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+using CacheStats = struct CacheStats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+// 渲染好的文字块, image 为透明背景, size 为排版尺寸
+using RenderedText = struct RenderedText
+{
+    QImage image;
+    QSize size;
+};
+
+// 按最终文字/字体/字号缓存渲染结果的 LRU 缓存, 可以在多个工作线程间共享
+class TextRenderCache
+{
+public:
+    using Entry = std::shared_ptr<const RenderedText>;
+
+    explicit TextRenderCache(size_t capacity = 256);
+
+    // 命中时直接返回, 否则在锁外调用 render 并放入缓存
+    Entry Get(const QString & key, const std::function<RenderedText()> & render);
+
+    void Clear();
+
+    CacheStats Stats() const;
+
+private:
+    using Item = std::pair<QString, Entry>;
+
+    size_t capacity_;
+    mutable std::mutex mutex_;
+    std::list<Item> items_; // 最近使用的在前
+    QHash<QString, std::list<Item>::iterator> index_;
+    std::atomic_size_t hits_ = 0;
+    std::atomic_size_t misses_ = 0;
+};
@@ -0,0 +1,279 @@
+﻿#include "text_renderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <QFontMetricsF>
+#include <QHash>
+#include <QPainter>
+#include <QTextDocument>
+#include <QTextLayout>
+#include <QtMath>
+
+namespace
+{
+constexpr qreal kLineHeight = 1.2; // 行高为字体高度的 120%
+constexpr int kMargin = 4; // 与 QTextDocument 默认的 documentMargin 相同
+constexpr qsizetype kMaxThreadFonts = 64;
+// 调整边框比例或尺寸各异的图片会不断产生新的边框尺寸
+constexpr size_t kMaxTemplates = 16;
+
+// 字号随图片尺寸变化, 每个线程缓存自己的 QFont, 不与其他线程共享同一个实例
+QFont GetThreadFont(const QFont & base, int pixel_size, int weight)
+{
+    thread_local QHash<QString, QFont> fonts;
+    const QString key = base.key() + QChar('\n') + QString::number(pixel_size) + QChar(':') + QString::number(weight);
+    const auto found = fonts.constFind(key);
+    if (found != fonts.cend())
+        return found.value();
+    if (fonts.size() >= kMaxThreadFonts)
+        fonts.clear();
+    QFont font(base);
+    font.setPixelSize(std::max(pixel_size, 1));
+    font.setWeight(static_cast<QFont::Weight>(std::clamp(weight, 1, 1000)));
+    return fonts.insert(key, font).value();
+}
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+}
+
+void TextBlock::Draw(QPainter * painter, const QPoint & pos) const
+{
+    if (top)
+        painter->drawImage(pos + QPoint(kMargin, kMargin), top->image);
+    if (bottom)
+        painter->drawImage(pos + QPoint(kMargin, bottom_y), bottom->image);
+}
+
+TextRenderer::TextRenderer(PipelineMetrics * metrics) : metrics_(metrics)
+{
+}
+
+void TextRenderer::Init(const QFont & font, const std::map<TextPosition, TextSetting> & settings, bool auto_align)
+{
+    // 设置改变后模板全部失效, 此时没有线程在绘制
+    {
+        std::lock_guard lock(template_mutex_);
+        templates_.clear();
+        template_index_.clear();
+    }
+    font_ = font;
+    auto_align_ = auto_align;
+    for (size_t i = 0; i < styles_.size(); ++i)
+    {
+        const auto position = static_cast<TextPosition>(i);
+        const bool is_top = position == TextPosition::kLeftTop || position == TextPosition::kRightTop;
+        TextLineStyle style;
+        const auto found = settings.find(position);
+        if (found != settings.end())
+        {
+            style.type = found->second.text_type;
+            style.custom_data = found->second.custom_data;
+            // 普通文字只排一行
+            if (style.type == TextType::kCustomString)
+                style.custom_data.replace(QChar('\n'), QChar(' '));
+            style.weight = found->second.weight > 0 ? found->second.weight : 400;
+        }
+        style.size_ratio = is_top ? 0.7 : 0.65;
+        style.color = is_top ? QColor(0x32, 0x32, 0x32) : QColor(0x50, 0x50, 0x50);
+        styles_[i] = style;
+    }
+}
+
+bool TextRenderer::IsEmpty(TextPosition top, TextPosition bottom) const
+{
+    return styles_[static_cast<size_t>(top)].type == TextType::kNone &&
+        styles_[static_cast<size_t>(bottom)].type == TextType::kNone;
+}
+
+TextBlock TextRenderer::Layout(TextPosition top, TextPosition bottom, const easyexif::EXIFInfo & exif,
+                               int board_size) const
+{
+    TextBlock block;
+    if (IsEmpty(top, bottom))
+        return block;
+
+    const auto text_template = GetTemplate(board_size);
+    block.top = RenderSlot(text_template->slots[static_cast<size_t>(top)], exif);
+    block.bottom = RenderSlot(text_template->slots[static_cast<size_t>(bottom)], exif);
+    if (!block.top && !block.bottom)
+        return block;
+
+    // 行高由模板确定, 只有宽度随文字变化
+    const QSize top_size = block.top ? block.top->size : QSize(0, 0);
+    const QSize bottom_size = block.bottom ? block.bottom->size : QSize(0, 0);
+    block.bottom_y = kMargin + top_size.height();
+    block.size = QSize(std::max(top_size.width(), bottom_size.width()) + 2 * kMargin,
+                       top_size.height() + bottom_size.height() + 2 * kMargin);
+    return block;
+}
+
+std::shared_ptr<const TextTemplate> TextRenderer::GetTemplate(int board_size) const
+{
+    {
+        std::lock_guard lock(template_mutex_);
+        auto found = template_index_.find(board_size);
+        if (found != template_index_.end())
+        {
+            templates_.splice(templates_.begin(), templates_, found->second);
+            return templates_.front().second;
+        }
+    }
+
+    // 在锁外编译, 其他线程同时编译了同一尺寸时保留先放入的一份
+    auto text_template = std::make_shared<TextTemplate>();
+    for (size_t i = 0; i < styles_.size(); ++i)
+        text_template->slots[i] = CompileSlot(styles_[i], board_size);
+
+    std::lock_guard lock(template_mutex_);
+    auto found = template_index_.find(board_size);
+    if (found != template_index_.end())
+        return found->second->second;
+    templates_.emplace_front(board_size, std::move(text_template));
+    template_index_.emplace(board_size, templates_.begin());
+    while (templates_.size() > kMaxTemplates)
+    {
+        template_index_.erase(templates_.back().first);
+        templates_.pop_back();
+    }
+    return templates_.front().second;
+}
+
+TextSlot TextRenderer::CompileSlot(const TextLineStyle & style, int board_size) const
+{
+    TextSlot slot;
+    slot.type = style.type;
+    if (style.type == TextType::KRichText)
+    {
+        slot.fixed = RenderRich(style.custom_data);
+        return slot;
+    }
+
+    slot.pixel_size = static_cast<int>(board_size * style.size_ratio);
+    slot.weight = style.weight;
+    slot.color = style.color;
+    slot.key = GetThreadFont(font_, slot.pixel_size, slot.weight).key() + QChar('\n') + style.color.name() + QChar('\n');
+    if (style.type == TextType::kCustomString && !style.custom_data.isEmpty())
+        slot.fixed = std::make_shared<const RenderedText>(RenderPlain(style.custom_data, slot));
+    else if (!auto_align_)
+        slot.blank = std::make_shared<const RenderedText>(RenderPlain(QChar(QChar::Nbsp), slot));
+    return slot;
+}
+
+TextRenderCache::Entry TextRenderer::RenderSlot(const TextSlot & slot, const easyexif::EXIFInfo & exif) const
+{
+    if (slot.fixed)
+        return slot.fixed;
+    // 另一行有内容时, 无与空的自定义字符串和 exif 中没有的内容相同
+    if (slot.type == TextType::kNone || slot.type == TextType::kCustomString)
+        return slot.blank;
+
+    const QString text = FormatExif(slot.type, exif);
+    if (text.isEmpty())
+        return slot.blank;
+    return cache_.Get(slot.key + text, [this, &text, &slot] { return RenderPlain(text, slot); });
+}
+
+RenderedText TextRenderer::RenderPlain(const QString & text, const TextSlot & slot) const
+{
+    const auto start = std::chrono::steady_clock::now();
+    const QFont font = GetThreadFont(font_, slot.pixel_size, slot.weight);
+    QTextLayout layout(text, font);
+    layout.setTextOption(QTextOption(Qt::AlignLeft));
+    layout.beginLayout();
+    QTextLine line = layout.createLine();
+    // 水印只有一行, 不换行
+    line.setNumColumns(static_cast<int>(text.size()));
+    line.setPosition(QPointF(0, 0));
+    layout.endLayout();
+
+    // 行高取字体的度量, 同一模板中的行高与文字内容无关
+    const QFontMetricsF metrics(font);
+    RenderedText rendered;
+    rendered.size = QSize(qCeil(line.naturalTextWidth()), qCeil((metrics.ascent() + metrics.descent()) * kLineHeight));
+    rendered.image = QImage(std::max(rendered.size.width(), 1), std::max(rendered.size.height(), 1),
+                            QImage::Format_ARGB32_Premultiplied);
+    rendered.image.fill(Qt::transparent);
+    QPainter painter(&rendered.image);
+    painter.setPen(slot.color);
+    layout.draw(&painter, QPointF(0, 0));
+    painter.end();
+    if (metrics_)
+        metrics_->AddLatency(MetricStage::kText, MillisecondsSince(start));
+    return rendered;
+}
+
+TextRenderCache::Entry TextRenderer::RenderRich(const QString & html) const
+{
+    const QString key = QStringLiteral("html\n") + font_.key() + QChar('\n') + html;
+    return cache_.Get(key, [this, &html]
+    {
+        const auto start = std::chrono::steady_clock::now();
+        QTextDocument td;
+        td.setDocumentMargin(0);
+        td.setDefaultFont(font_);
+        td.setDefaultTextOption(QTextOption(Qt::AlignVCenter | Qt::AlignLeft));
+        td.setHtml(html);
+
+        RenderedText rendered;
+        const QSizeF doc_size = td.size();
+        rendered.size = doc_size.toSize();
+        rendered.image = QImage(std::max(qCeil(doc_size.width()), 1), std::max(qCeil(doc_size.height()), 1),
+                                QImage::Format_ARGB32_Premultiplied);
+        rendered.image.fill(Qt::transparent);
+        QPainter painter(&rendered.image);
+        td.drawContents(&painter);
+        painter.end();
+        if (metrics_)
+            metrics_->AddLatency(MetricStage::kText, MillisecondsSince(start));
+        return rendered;
+    });
+}
+
+QString TextRenderer::FormatExif(TextType type, const easyexif::EXIFInfo & exif)
+{
+    switch (type)
+    {
+    case TextType::kModel:
+        return QString::fromStdString(exif.Model);
+    case TextType::kLensModel:
+        return QString::fromStdString(exif.LensInfo.Model);
+    case TextType::kExposureParam:
+    {
+        const int num = exif.ExposureTime > 0 ? static_cast<int>(1.0 / exif.ExposureTime) : 0;
+        return QString::asprintf("%dmm ISO%d 1/%d f/%.1lf", exif.FocalLengthIn35mm,
+                                 exif.ISOSpeedRatings, num, exif.FNumber);
+    }
+    case TextType::kData:
+        return QString::fromStdString(exif.DateTime);
+    case TextType::kGps:
+    {
+        const auto & longitude = exif.GeoLocation.LonComponents;
+        const auto & latitude = exif.GeoLocation.LatComponents;
+        return QString::asprintf("%d°%d'%d\"%c %d°%d'%d\"%c",
+                                 static_cast<int>(latitude.degrees), static_cast<int>(latitude.minutes),
+                                 static_cast<int>(latitude.seconds), latitude.direction,
+                                 static_cast<int>(longitude.degrees), static_cast<int>(longitude.minutes),
+                                 static_cast<int>(longitude.seconds), longitude.direction);
+    }
+    default:
+        return QString();
+    }
+}
+
+CacheStats TextRenderer::GetCacheStats() const
+{
+    return cache_.Stats();
+}
+
+void TextRenderer::ClearCache()
+{
+    {
+        std::lock_guard lock(template_mutex_);
+        templates_.clear();
+        template_index_.clear();
+    }
+    cache_.Clear();
+}
@@ -0,0 +1,122 @@
+﻿#pragma once
+#include <array>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <QColor>
+#include <QFont>
+#include <QPoint>
+#include <QSize>
+#include <QString>
+
+#include "exif.h"
+#include "pipeline_metrics.h"
+#include "render_cache.h"
+#include "utils.h"
+
+class QPainter;
+
+using TextPosition = enum class TextPosition
+{
+    kLeftTop,
+    kRightTop,
+    kLeftBottom,
+    kRightBottom,
+};
+
+using TextSetting = struct TextSetting
+{
+    TextType text_type = TextType::kNone;
+    QString custom_data;
+    int weight = 0;
+};
+
+// 一行文字的样式, 由 TextSetting 在处理开始前生成
+using TextLineStyle = struct TextLineStyle
+{
+    TextType type = TextType::kNone;
+    QString custom_data; // kCustomString 为纯文本, KRichText 为 html
+    int weight = 400;
+    qreal size_ratio = 0; // 字号像素 = 边框像素 * size_ratio
+    QColor color;
+};
+
+// 排版模板中的一行, 字号、行高与固定内容在第一次遇到这个边框尺寸时确定
+using TextSlot = struct TextSlot
+{
+    TextType type = TextType::kNone;
+    int pixel_size = 0;
+    int weight = 400;
+    QColor color;
+    QString key; // 字体与颜色, exif 文字渲染缓存键的前缀
+    TextRenderCache::Entry fixed; // 自定义字符串与富文本, 每个模板只渲染一次
+    TextRenderCache::Entry blank; // exif 中没有内容且不自动居中时的占位行
+};
+
+// 一种边框尺寸的排版模板, 每张图片只需要排版 exif 文字
+using TextTemplate = struct TextTemplate
+{
+    std::array<TextSlot, 4> slots; // 下标为 TextPosition
+};
+
+// 一侧排版好的上下两行, 每行是缓存中的一张图片
+using TextBlock = struct TextBlock
+{
+    TextRenderCache::Entry top; // 没有内容时为空
+    TextRenderCache::Entry bottom;
+    int bottom_y = 0; // 下一行相对块顶部的位置
+    QSize size; // 包含边距, 两行都没有时为空
+
+    // pos 为块的左上角
+    void Draw(QPainter * painter, const QPoint & pos) const;
+};
+
+// 水印文字的排版与渲染
+// Init 在处理开始前调用, 之后 Layout 只读取不可变的设置, 可以在任意多个线程中同时调用
+// 设置按边框尺寸编译为模板, 普通文字用 QTextLayout 直接排版, 字体按线程缓存; 富文本只解析一次
+class TextRenderer
+{
+public:
+    explicit TextRenderer(PipelineMetrics * metrics = nullptr);
+
+    void Init(const QFont & font, const std::map<TextPosition, TextSetting> & settings, bool auto_align);
+
+    bool IsEmpty(TextPosition top, TextPosition bottom) const;
+
+    TextBlock Layout(TextPosition top, TextPosition bottom, const easyexif::EXIFInfo & exif, int board_size) const;
+
+    // exif 中没有对应内容时返回空字符串
+    static QString FormatExif(TextType type, const easyexif::EXIFInfo & exif);
+
+    CacheStats GetCacheStats() const;
+
+    // 清空文字缓存与版式模板, 下一张图片从头排版
+    void ClearCache();
+
+private:
+    // 模板按 LRU 保留, 返回的指针在被淘汰后仍然有效
+    std::shared_ptr<const TextTemplate> GetTemplate(int board_size) const;
+
+    TextSlot CompileSlot(const TextLineStyle & style, int board_size) const;
+
+    TextRenderCache::Entry RenderSlot(const TextSlot & slot, const easyexif::EXIFInfo & exif) const;
+
+    RenderedText RenderPlain(const QString & text, const TextSlot & slot) const;
+
+    TextRenderCache::Entry RenderRich(const QString & html) const;
+
+    PipelineMetrics * metrics_ = nullptr;
+    mutable TextRenderCache cache_;
+
+    QFont font_;
+    std::array<TextLineStyle, 4> styles_; // 下标为 TextPosition
+    bool auto_align_ = false;
+
+    using TemplateItem = std::pair<int, std::shared_ptr<const TextTemplate>>; // <border size, template>
+
+    // 由 template_mutex_ 保护
+    mutable std::mutex template_mutex_;
+    mutable std::list<TemplateItem> templates_; // 最近使用的在前
+    mutable std::map<int, std::list<TemplateItem>::iterator> template_index_;
+};